@@ -5,6 +5,21 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
 
 #include "ext4.h"
 
@@ -14,17 +29,38 @@
         e->message_cb(e->priv, true, __func__, __LINE__, fmt, ##args); \
     } while (0)
 
-#define debug(fmt, args...)                                             \
-    do                                                                  \
-    {                                                                   \
-        e->message_cb(e->priv, false, __func__, __LINE__, fmt, ##args); \
+/* messages above EXT4FS_LOG_LEVEL are compiled out. others cost a branch on
+ * e->log_level, and arguments are not evaluated unless enabled.
+ */
+#ifndef EXT4FS_LOG_LEVEL
+#define EXT4FS_LOG_LEVEL EXT4FS_LOG_DUMP
+#endif
+
+#define log_enabled(level) \
+    ((level) <= EXT4FS_LOG_LEVEL && __builtin_expect((level) <= e->log_level, 0))
+
+#define debug(fmt, args...)                                                 \
+    do                                                                      \
+    {                                                                       \
+        if (log_enabled(EXT4FS_LOG_DEBUG))                                  \
+            e->message_cb(e->priv, false, __func__, __LINE__, fmt, ##args); \
+    } while (0)
+
+// on-disk structures field by field.
+#define dump(fmt, args...)                                                  \
+    do                                                                      \
+    {                                                                       \
+        if (log_enabled(EXT4FS_LOG_DUMP))                                   \
+            e->message_cb(e->priv, false, __func__, __LINE__, fmt, ##args); \
     } while (0)
 
-typedef uint64_t __le64;
+typedef unsigned long long __le64; // same as <linux/types.h>
 typedef uint32_t __u32;
 typedef uint32_t __le32;
 typedef uint16_t __le16;
 typedef uint8_t __u8;
+typedef uint32_t __be32; // jbd2 journal. see be32toh().
+typedef uint16_t __be16;
 
 // https://ext4.wiki.kernel.org/index.php/Ext4_Disk_Layout
 struct super_block
@@ -57,10 +93,22 @@ struct super_block
     __le32 s_first_ino;            // 0x54
     __le16 s_inode_size;           // 0x58
     __le16 s_block_group_nr;       // 0x5A
+
+#define EXT4_FEATURE_COMPAT_HAS_JOURNAL 0x4
+#define EXT4_FEATURE_COMPAT_DIR_INDEX 0x20
+#define EXT4_FEATURE_COMPAT_SPARSE_SUPER2 0x200
     __le32 s_feature_compat;       // 0x5C
 
+#define EXT4_FEATURE_INCOMPAT_RECOVER 0x4 // journal needs recovery
+#define EXT4_FEATURE_INCOMPAT_META_BG 0x10
 #define EXT4_FEATURE_COMPAT_64BIT 0x80
+#define EXT4_FEATURE_INCOMPAT_CSUM_SEED 0x2000
+#define EXT4_FEATURE_INCOMPAT_INLINE_DATA 0x8000
     __le32 s_feature_incompat;       // 0x60
+
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER 0x1
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM 0x10
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM 0x400
     __le32 s_feature_ro_compat;      // 0x64
     __u8 s_uuid[16];                 // 0x68
     char s_volume_name[16];          // 0x78
@@ -88,12 +136,15 @@ struct super_block
     __le32 s_free_blocks_count_hi;    // 0x158
     __le16 s_min_extra_isize;         // 0x15C
     __le16 s_want_extra_isize;        // 0x15E
+
+#define EXT2_FLAGS_UNSIGNED_HASH 0x2
     __le32 s_flags;                   // 0x160
     __le16 s_raid_stride;             // 0x164
     __le16 s_mmp_interval;            // 0x166
     __le64 s_mmp_block;               // 0x168
     __le32 s_raid_stripe_width;       // 0x170
     __u8 s_log_groups_per_flex;       // 0x174
+#define EXT4_CRC32C_CHKSUM 1
     __u8 s_checksum_type;             // 0x175
     __le16 s_reserved_pad;            // 0x176
     __le64 s_kbytes_written;          // 0x178
@@ -134,6 +185,9 @@ struct group_desc
     __le16 bg_free_blocks_count_lo; // 0xC
     __le16 bg_free_inodes_count_lo; // 0xE
     __le16 bg_used_dirs_count_lo;   // 0x10
+
+#define EXT4_BG_INODE_UNINIT 0x1 // inode table and bitmap not initialized
+#define EXT4_BG_BLOCK_UNINIT 0x2 // block bitmap not initialized
     __le16 bg_flags;                // 0x12
     __le32 bg_exclude_bitmap_lo;    // 0x14
     __le16 bg_block_bitmap_csum_lo; // 0x18
@@ -155,8 +209,25 @@ struct group_desc
     __u32 bg_reserved;              // 0x3C
 };
 
+// decoded group descriptor.
+struct bg_info
+{
+    uint64_t block_bitmap;
+    uint64_t inode_bitmap;
+    uint64_t inode_table;
+    uint32_t free_blocks_count;
+    uint32_t free_inodes_count;
+    uint32_t used_dirs_count;
+    uint32_t itable_unused;
+    uint16_t flags;
+};
+
+#define BG_CHUNK_BLOCKS 16 // descriptor blocks loaded at once
+
 struct inode
 {
+// same values as <sys/stat.h>.
+#ifndef S_IFMT
 #define S_IXOTH 0x1     // Others may execute
 #define S_IWOTH 0x2     // Others may write
 #define S_IROTH 0x4     // Others may read
@@ -176,6 +247,7 @@ struct inode
 #define S_IFREG 0x8000  // Regular file
 #define S_IFLNK 0xA000  // Symbolic link
 #define S_IFSOCK 0xC000 // Socket
+#endif
 
     __le16 i_mode;        // 0x0
     __le16 i_uid;         // 0x2
@@ -190,6 +262,7 @@ struct inode
 
 #define EXT4_INDEX_FL 0x1000
 #define EXT4_EXTENTS_FL 0x80000
+#define EXT4_INLINE_DATA_FL 0x10000000
     __le32 i_flags;        // 0x20
     __le32 l_i_version;    // 0x24
     __u8 i_block[60];      // 0x28
@@ -197,7 +270,12 @@ struct inode
     __le32 i_file_acl_lo;  // 0x68
     __le32 i_size_hi;      // 0x6C
     __le32 i_obso_faddr;   // 0x70
-    __u8 osd2[12];         // 0x74
+    __le16 l_i_blocks_high;   // 0x74
+    __le16 l_i_file_acl_high; // 0x76
+    __le16 l_i_uid_high;      // 0x78
+    __le16 l_i_gid_high;      // 0x7A
+    __le16 l_i_checksum_lo;   // 0x7C
+    __le16 l_i_reserved;      // 0x7E
     __le16 i_extra_isize;  // 0x80
     __le16 i_checksum_hi;  // 0x82
     __le32 i_ctime_extra;  // 0x84
@@ -209,312 +287,1678 @@ struct inode
     __le32 i_projid;       // 0x9C
 };
 
+#define EXT4_GOOD_OLD_INODE_SIZE 128
+#define EXT4_MIN_INLINE_DATA_SIZE 60 // inline data in i_block. the rest is in system.data xattr.
+
+/* block cache.
+ *
+ * metadata blocks are kept in a LRU list per shard. block number selects the
+ * shard, so lookups from several threads mostly take different locks.
+ */
+#define CACHE_SHARDS 16
+#define CACHE_DEFAULT_SIZE (8 * 1024 * 1024)
+
+struct cache_entry
+{
+    uint64_t blk;
+    uint64_t checked;          // parts of the block with verified checksum
+    struct cache_entry *hnext; // hash chain
+    struct cache_entry *prev;  // lru, most recently used first
+    struct cache_entry *next;
+    uint8_t data[0];
+};
+
+struct cache_shard
+{
+    pthread_mutex_t lock;
+
+    struct cache_entry **hash;
+    uint32_t hash_size;
+
+    struct cache_entry *head;
+    struct cache_entry *tail;
+
+    uint64_t bytes;
+    uint64_t max_bytes;
+
+    uint64_t hits;
+    uint64_t misses;
+};
+
+struct block_cache
+{
+    uint64_t size; // total byte budget. 0 disables the cache.
+    bool enabled;
+    struct cache_shard shard[CACHE_SHARDS];
+};
+
+/* dentry cache.
+ *
+ * (parent inode, name) -> inode of path lookups. inode 0 is kept for names
+ * which do not exist. least recently used entries are dropped when there are
+ * more than 'max' entries.
+ */
+#define DCACHE_DEFAULT_ENTRIES 65536
+
+struct dcache_entry
+{
+    uint32_t parent;
+    uint32_t inode_index; // 0 if not exist
+    struct dcache_entry *hnext;
+    struct dcache_entry *prev;
+    struct dcache_entry *next;
+    uint8_t name_len;
+    char name[0];
+};
+
+struct dcache
+{
+    pthread_mutex_t lock;
+    uint32_t max;
+    uint32_t count;
+
+    struct dcache_entry **hash;
+    uint32_t hash_size;
+
+    struct dcache_entry *head;
+    struct dcache_entry *tail;
+
+    uint64_t hits;
+    uint64_t misses;
+};
+
+// filesystem block and its last committed copy in the journal.
+struct journal_block
+{
+    uint64_t blk;
+    uint64_t phys;
+    uint8_t *data; // escaped block with magic restored. read instead of 'phys'.
+};
+
 struct ext4fs
 {
     void *priv;
 
     ext4fs_read_cb_t read_cb;
+    ext4fs_readv_cb_t readv_cb;
+    ext4fs_borrow_cb_t borrow_cb;
+    ext4fs_copy_cb_t copy_cb;
     ext4fs_message_cb_t message_cb;
+    int log_level;
 
     uint32_t block_size;
 
     struct super_block sb;
-    struct group_desc *bg;
+
+    // metadata checksums. 'csum' if requested and the filesystem has them.
+    bool verify;
+    bool csum;
+    uint32_t csum_seed;
+    uint64_t csum_checks;
+    uint64_t csum_cached;
+
+    // group descriptors. loaded by chunks of BG_CHUNK_BLOCKS descriptor blocks
+    // on first use.
+    uint32_t bg_count;
+    uint32_t bg_desc_size;
+    uint32_t bg_per_block;
+    uint32_t bg_chunk_count;
+    struct bg_info **bg_chunk;
+    pthread_mutex_t bg_lock;
+
+    struct block_cache cache;
+
+    // requests to the image. updated atomically.
+    uint64_t read_batches;
+    uint64_t reads;
+    uint64_t read_bytes;
+
+    struct dcache dcache;
+
+    // blocks replayed from the journal, sorted by 'blk'. see journal_load().
+    bool journal_replay;
+    uint32_t journal_count;
+    struct journal_block *journal;
+    uint64_t journal_transactions;
 };
 
-struct ext4fs *ext4fs_new(void *priv)
+static void cache_init(struct ext4fs *e)
 {
-    struct ext4fs *e;
+    struct block_cache *c = &e->cache;
+    uint64_t entry_size = sizeof(struct cache_entry) + e->block_size;
+    uint64_t shard_bytes = c->size / CACHE_SHARDS;
+    uint32_t hash_size = 1;
+    int i;
 
-    e = calloc(1, sizeof(*e));
-    if (!e)
-        return NULL;
+    if (shard_bytes < entry_size)
+    {
+        debug("block cache disabled. size %llu\n", (long long)c->size);
+        return;
+    }
 
-    e->priv = priv;
+    while (hash_size < shard_bytes / entry_size)
+        hash_size <<= 1;
 
-    return e;
-}
+    for (i = 0; i < CACHE_SHARDS; i++)
+    {
+        struct cache_shard *s = &c->shard[i];
+
+        pthread_mutex_init(&s->lock, NULL);
+        s->hash = calloc(hash_size, sizeof(s->hash[0]));
+        if (!s->hash)
+            fatal("no mem for cache hash. %u\n", hash_size);
+        s->hash_size = hash_size;
+        s->max_bytes = shard_bytes;
+    }
+    c->enabled = true;
 
-void ext4fs_del(struct ext4fs *e)
-{
-    if (e->bg)
-        free(e->bg);
-    free(e);
+    debug("block cache %llu bytes, %d shards, %u hash buckets per shard\n",
+          (long long)c->size, CACHE_SHARDS, hash_size);
 }
 
-static void do_read(struct ext4fs *e, uint64_t offs, void *data, uint32_t size)
+static void cache_free(struct ext4fs *e)
 {
-    e->read_cb(e->priv, offs, data, size);
-}
+    struct block_cache *c = &e->cache;
+    int i;
 
-static char *arr2str(struct ext4fs *e, void *ptr, int i, int total, int esize)
-{
-    char *s;
-    uint64_t d = 0;
-    int r;
+    if (!c->enabled)
+        return;
 
-    switch (esize)
+    for (i = 0; i < CACHE_SHARDS; i++)
     {
-    case 1:
-        d = *(uint8_t *)(ptr + i * esize);
-        break;
-    case 2:
-        d = *(uint16_t *)(ptr + i * esize);
-        break;
-    case 4:
-        d = *(uint32_t *)(ptr + i * esize);
-        break;
-    case 8:
-        d = *(uint64_t *)(ptr + i * esize);
-        break;
-    default:
-        fatal("unknown esize. %d\n", esize);
-    }
+        struct cache_shard *s = &c->shard[i];
+        struct cache_entry *ce, *next;
 
-    if (i + 1 != total)
-    {
-        char *n = arr2str(e, ptr, i + 1, total, esize);
-        r = asprintf(&s, "%0*llx %s", esize * 2, (long long)d, n);
-        free(n);
+        for (ce = s->head; ce; ce = next)
+        {
+            next = ce->next;
+            free(ce);
+        }
+        free(s->hash);
+        pthread_mutex_destroy(&s->lock);
     }
-    else
-        r = asprintf(&s, "%0*llx", esize * 2, (long long)d);
-
-    if (r < 0)
-        fatal("asprintf() failed.\n");
-
-    return s;
+    c->enabled = false;
 }
 
-static bool is_64bit(struct ext4fs *e)
+static uint64_t cache_hash(uint64_t blk)
 {
-    return !!(e->sb.s_feature_incompat & EXT4_FEATURE_COMPAT_64BIT);
+    return blk * 0x9e3779b97f4a7c15ull;
 }
 
-static void read_sb(struct ext4fs *e)
+static struct cache_shard *cache_shard(struct ext4fs *e, uint64_t blk)
 {
-    if (sizeof(e->sb) != 0x400)
-        fatal("sizeof(sb) is not 0x400. %d\n", sizeof(e->sb));
-    do_read(e, 0x400, &e->sb, sizeof(e->sb));
+    return &e->cache.shard[cache_hash(blk) >> 60];
+}
 
-#define print_sb_(m) debug("(%03x) %-28s= 0x%0*llx(%llu)\n",            \
-                           (int)(long)&((struct super_block *)NULL)->m, \
-                           #m, sizeof(e->sb.m) * 2,                     \
-                           (long long)e->sb.m, (long long)e->sb.m)
-#define print_sbs(m) debug("(%03x) %-28s= \"%s\"\n",                       \
-                           (int)(long)&((struct super_block *)NULL)->m[0], \
-                           #m, e->sb.m)
-#define print_sba(m)                                          \
-    do                                                        \
-    {                                                         \
-        char *s;                                              \
-        s = arr2str(e, e->sb.m,                               \
-                    0, sizeof(e->sb.m) / sizeof(e->sb.m[0]),  \
-                    sizeof(e->sb.m[0]));                      \
-        debug("(%03x) %-28s= %s\n",                           \
-              (int)(long)&((struct super_block *)NULL)->m[0], \
-              #m, s);                                         \
-        free(s);                                              \
-    } while (0)
-    print_sb_(s_inodes_count);
-    print_sb_(s_blocks_count_lo);
-    print_sb_(s_r_blocks_count_lo);
-    print_sb_(s_free_blocks_count_lo);
-    print_sb_(s_free_inodes_count);
-    print_sb_(s_first_data_block);
-    print_sb_(s_log_block_size);
-    print_sb_(s_log_cluster_size);
-    print_sb_(s_blocks_per_group);
-    print_sb_(s_clusters_per_group);
-    print_sb_(s_inodes_per_group);
-    print_sb_(s_mtime);
-    print_sb_(s_wtime);
-    print_sb_(s_mnt_count);
-    print_sb_(s_max_mnt_count);
-    print_sb_(s_magic);
-    print_sb_(s_state);
-    print_sb_(s_errors);
-    print_sb_(s_minor_rev_level);
-    print_sb_(s_lastcheck);
-    print_sb_(s_checkinterval);
-    print_sb_(s_creator_os);
-    print_sb_(s_rev_level);
-    print_sb_(s_def_resuid);
-    print_sb_(s_def_resgid);
-    print_sb_(s_first_ino);
-    print_sb_(s_inode_size);
-    print_sb_(s_block_group_nr);
-    print_sb_(s_feature_compat);
-    print_sb_(s_feature_incompat);
-    print_sb_(s_feature_ro_compat);
-    print_sba(s_uuid);
-    print_sbs(s_volume_name);
-    print_sbs(s_last_mounted);
-    print_sb_(s_algorithm_usage_bitmap);
-    print_sb_(s_prealloc_blocks);
-    print_sb_(s_prealloc_dir_blocks);
-    print_sb_(s_reserved_gdt_blocks);
-    print_sba(s_journal_uuid);
-    print_sb_(s_journal_inum);
-    print_sb_(s_journal_dev);
-    print_sb_(s_last_orphan);
-    print_sba(s_hash_seed);
-    print_sb_(s_def_hash_version);
-    print_sb_(s_jnl_backup_type);
-    print_sb_(s_desc_size);
-    print_sb_(s_default_mount_opts);
-    print_sb_(s_first_meta_bg);
-    print_sb_(s_mkfs_time);
-    print_sba(s_jnl_blocks);
-    if (is_64bit(e))
-    {
-        print_sb_(s_blocks_count_hi);
-        print_sb_(s_r_blocks_count_hi);
-        print_sb_(s_free_blocks_count_hi);
-        print_sb_(s_min_extra_isize);
-        print_sb_(s_want_extra_isize);
-        print_sb_(s_flags);
-        print_sb_(s_raid_stride);
-        print_sb_(s_mmp_interval);
-        print_sb_(s_mmp_block);
-        print_sb_(s_raid_stripe_width);
-        print_sb_(s_log_groups_per_flex);
-        print_sb_(s_checksum_type);
-        print_sb_(s_reserved_pad);
-        print_sb_(s_kbytes_written);
-        print_sb_(s_snapshot_inum);
-        print_sb_(s_snapshot_id);
-        print_sb_(s_snapshot_r_blocks_count);
-        print_sb_(s_snapshot_list);
-        print_sb_(s_error_count);
-        print_sb_(s_first_error_time);
-        print_sb_(s_first_error_ino);
-        print_sb_(s_first_error_block);
-        print_sbs(s_first_error_func);
-        print_sb_(s_first_error_line);
-        print_sb_(s_last_error_time);
-        print_sb_(s_last_error_ino);
-        print_sb_(s_last_error_line);
-        print_sb_(s_last_error_block);
-        print_sbs(s_last_error_func);
-        print_sbs(s_mount_opts);
-        print_sb_(s_usr_quota_inum);
-        print_sb_(s_grp_quota_inum);
-        print_sb_(s_overhead_blocks);
-        print_sba(s_backup_bgs);
-        print_sba(s_encrypt_algos);
-        print_sba(s_encrypt_pw_salt);
-        print_sb_(s_lpf_ino);
-        print_sb_(s_prj_quota_inum);
-        print_sb_(s_checksum_seed);
-        // print_sb_(s_reserved[98]);
-        print_sb_(s_checksum);
-    }
-#undef print_sb_
-#undef print_sbs
-#undef print_sba
+static struct cache_entry **cache_bucket(struct cache_shard *s, uint64_t blk)
+{
+    return &s->hash[(cache_hash(blk) >> 24) & (s->hash_size - 1)];
+}
 
-    if (e->sb.s_magic != 0xef53)
-        fatal("wrong magic. 0x%04x\n", e->sb.s_magic);
+static void cache_lru_unlink(struct cache_shard *s, struct cache_entry *ce)
+{
+    if (ce->prev)
+        ce->prev->next = ce->next;
+    else
+        s->head = ce->next;
+    if (ce->next)
+        ce->next->prev = ce->prev;
+    else
+        s->tail = ce->prev;
+}
 
-    e->block_size = 1 << (10 + e->sb.s_log_block_size);
-    debug("block size %u\n", e->block_size);
-    debug("inode size %u\n", e->sb.s_inode_size);
-    debug("64bit filesystem %d\n", is_64bit(e));
+static void cache_lru_push(struct cache_shard *s, struct cache_entry *ce)
+{
+    ce->prev = NULL;
+    ce->next = s->head;
+    if (s->head)
+        s->head->prev = ce;
+    else
+        s->tail = ce;
+    s->head = ce;
 }
 
-static void read_bg(struct ext4fs *e)
+// must be called with shard locked.
+static struct cache_entry *cache_lookup(struct cache_shard *s, uint64_t blk)
 {
-    int bg_count;
-    int i;
+    struct cache_entry *ce;
 
-    bg_count = e->sb.s_inodes_count / e->sb.s_inodes_per_group;
-    debug("block group descriptors %d\n", bg_count);
-    e->bg = calloc(bg_count, sizeof(e->bg[0]));
-    if (!e->bg)
-        fatal("no mem for block group. %d\n", bg_count);
-
-    for (i = 0; i < bg_count; i++)
-    {
-        do_read(e,
-                (0x400 / e->block_size + 1) * e->block_size +
-                    e->sb.s_desc_size * i,
-                e->bg + i, e->sb.s_desc_size);
-
-#define print_bg(m) debug("(%02x) bg[%d].%-28s= 0x%0*llx(%llu)\n",    \
-                          (int)(long)&((struct group_desc *)NULL)->m, \
-                          i, #m,                                      \
-                          sizeof(e->bg[i].m) * 2,                     \
-                          (long long)e->bg[i].m, (long long)e->bg[i].m)
-        print_bg(bg_block_bitmap_lo);
-        print_bg(bg_inode_bitmap_lo);
-        print_bg(bg_inode_table_lo);
-        print_bg(bg_free_blocks_count_lo);
-        print_bg(bg_free_inodes_count_lo);
-        print_bg(bg_used_dirs_count_lo);
-        print_bg(bg_flags);
-        print_bg(bg_exclude_bitmap_lo);
-        print_bg(bg_block_bitmap_csum_lo);
-        print_bg(bg_inode_bitmap_csum_lo);
-        print_bg(bg_itable_unused_lo);
-        print_bg(bg_checksum);
-        if (is_64bit(e))
-        {
-            print_bg(bg_block_bitmap_hi);
-            print_bg(bg_inode_bitmap_hi);
-            print_bg(bg_inode_table_hi);
-            print_bg(bg_free_blocks_count_hi);
-            print_bg(bg_free_inodes_count_hi);
-            print_bg(bg_used_dirs_count_hi);
-            print_bg(bg_itable_unused_hi);
-            print_bg(bg_exclude_bitmap_hi);
-            print_bg(bg_block_bitmap_csum_hi);
-            print_bg(bg_inode_bitmap_csum_hi);
-            // print_bg(bg_reserved);
+    for (ce = *cache_bucket(s, blk); ce; ce = ce->hnext)
+        if (ce->blk == blk)
+        {
+            if (s->head != ce)
+            {
+                cache_lru_unlink(s, ce);
+                cache_lru_push(s, ce);
+            }
+            return ce;
         }
 
-#undef print_bg
-    }
+    return NULL;
 }
 
-#define get64(m) ((((uint64_t)m##_hi) << 32) | ((uint64_t)m##_lo))
-
-static uint64_t inode_offset(struct ext4fs *e, uint32_t inode_index)
+// must be called with shard locked.
+static void cache_evict(struct ext4fs *e, struct cache_shard *s)
 {
-    uint32_t group_index;
-    uint32_t index_in_group;
-    uint64_t offset;
+    uint64_t entry_size = sizeof(struct cache_entry) + e->block_size;
 
-    inode_index--;
-    group_index = inode_index / e->sb.s_inodes_per_group;
-    index_in_group = inode_index % e->sb.s_inodes_per_group;
+    while (s->tail && s->bytes + entry_size > s->max_bytes)
+    {
+        struct cache_entry *ce = s->tail;
+        struct cache_entry **pp;
 
-    offset = get64(e->bg[group_index].bg_inode_table) * e->block_size;
-    offset += index_in_group * e->sb.s_inode_size;
+        for (pp = cache_bucket(s, ce->blk); *pp != ce; pp = &(*pp)->hnext)
+            ;
+        *pp = ce->hnext;
 
-    return offset;
+        cache_lru_unlink(s, ce);
+        s->bytes -= entry_size;
+        free(ce);
+    }
 }
 
-static void read_inode(struct ext4fs *e, uint32_t inode_index, struct inode *inode)
+/* cache entries remember which parts of the block were verified. bit i is
+ * i'th 1/64 of the block. a range is verified if all parts it touches are set.
+ * verifying a range sets only the parts it covers whole.
+ */
+static uint64_t cache_part_mask(struct ext4fs *e, uint32_t offset_in_block, uint32_t size, bool whole)
 {
-    uint64_t offset;
-    uint32_t inode_size;
-
-    offset = inode_offset(e, inode_index);
-    debug("inode[%d] offset 0x%08llx\n", inode_index, offset);
+    uint32_t part = e->block_size / 64;
+    uint32_t first, last;
 
-    inode_size = e->sb.s_inode_size;
-    if (inode_size > sizeof(*inode))
-        inode_size = sizeof(*inode);
-
-    do_read(e, offset, inode, inode_size);
-
-#define print_i__(m, f) debug("(%02x) inode[%d].%-28s= 0x%0*llx(" f ")\n", \
-                              (int)(long)&((struct inode *)NULL)->m,       \
-                              inode_index, #m,                             \
-                              sizeof(inode->m) * 2,                        \
-                              (long long)inode->m, (long long)inode->m)
-#define print_i_(m) print_i__(m, "%llu")
+    if (whole)
+    {
+        first = (offset_in_block + part - 1) / part;
+        last = (offset_in_block + size) / part;
+    }
+    else
+    {
+        first = offset_in_block / part;
+        last = (offset_in_block + size + part - 1) / part;
+    }
+    if (first >= last)
+        return 0;
+    if (last - first == 64)
+        return ~0ull;
+
+    return ((1ull << (last - first)) - 1) << first;
+}
+
+// marks or tests verified range of cached block 'blk'.
+static bool cache_checked(struct ext4fs *e, uint64_t blk, uint32_t offset_in_block, uint32_t size,
+                          bool mark)
+{
+    struct cache_shard *s = cache_shard(e, blk);
+    struct cache_entry *ce;
+    uint64_t mask = cache_part_mask(e, offset_in_block, size, mark);
+    bool checked = false;
+
+    pthread_mutex_lock(&s->lock);
+    ce = cache_lookup(s, blk);
+    if (ce && mark)
+        ce->checked |= mask;
+    else if (ce)
+        checked = mask && (ce->checked & mask) == mask;
+    pthread_mutex_unlock(&s->lock);
+
+    return checked;
+}
+
+/* copy part of block 'blk' if it is cached. returns false on miss.
+ * misses are counted only if 'count_miss'. '*checked' is set if the part had
+ * its checksum verified.
+ */
+static bool cache_copy(struct ext4fs *e, uint64_t blk, uint32_t offset_in_block,
+                       void *data, uint32_t size, bool count_miss, bool *checked)
+{
+    struct cache_shard *s = cache_shard(e, blk);
+    struct cache_entry *ce;
+
+    pthread_mutex_lock(&s->lock);
+    ce = cache_lookup(s, blk);
+    if (ce)
+    {
+        s->hits++;
+        memcpy(data, ce->data + offset_in_block, size);
+        if (checked)
+        {
+            uint64_t mask = cache_part_mask(e, offset_in_block, size, false);
+
+            *checked = (ce->checked & mask) == mask;
+        }
+    }
+    else if (count_miss)
+        s->misses++;
+    pthread_mutex_unlock(&s->lock);
+
+    return !!ce;
+}
+
+static void cache_count(struct ext4fs *e, uint64_t blk, bool hit)
+{
+    struct cache_shard *s = cache_shard(e, blk);
+
+    pthread_mutex_lock(&s->lock);
+    if (hit)
+        s->hits++;
+    else
+        s->misses++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+static struct cache_entry *cache_alloc(struct ext4fs *e, uint64_t blk)
+{
+    struct cache_entry *ce;
+
+    ce = malloc(sizeof(*ce) + e->block_size);
+    if (!ce)
+        fatal("no mem for cache entry.\n");
+    ce->blk = blk;
+    ce->checked = 0;
+
+    return ce;
+}
+
+/* insert newly read block. blocks are read without the shard lock, so someone
+ * else may have inserted the same block meanwhile. then 'ce' is dropped.
+ */
+static void cache_insert(struct ext4fs *e, struct cache_entry *ce)
+{
+    struct cache_shard *s = cache_shard(e, ce->blk);
+    struct cache_entry **bucket;
+
+    pthread_mutex_lock(&s->lock);
+    if (cache_lookup(s, ce->blk))
+        free(ce);
+    else
+    {
+        cache_evict(e, s);
+        bucket = cache_bucket(s, ce->blk);
+        ce->hnext = *bucket;
+        *bucket = ce;
+        cache_lru_push(s, ce);
+        s->bytes += sizeof(*ce) + e->block_size;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void count_reads(struct ext4fs *e, uint64_t batches, uint64_t reads, uint64_t bytes)
+{
+    __atomic_add_fetch(&e->read_batches, batches, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&e->reads, reads, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&e->read_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+static void dcache_init(struct ext4fs *e)
+{
+    struct dcache *d = &e->dcache;
+
+    if (d->max == 0)
+        return;
+
+    d->hash_size = 1;
+    while (d->hash_size < d->max)
+        d->hash_size <<= 1;
+
+    d->hash = calloc(d->hash_size, sizeof(d->hash[0]));
+    if (!d->hash)
+        fatal("no mem for dentry cache. %u\n", d->hash_size);
+}
+
+static void dcache_free(struct ext4fs *e)
+{
+    struct dcache *d = &e->dcache;
+    struct dcache_entry *de, *next;
+
+    for (de = d->head; de; de = next)
+    {
+        next = de->next;
+        free(de);
+    }
+    free(d->hash);
+    d->hash = NULL;
+    d->head = d->tail = NULL;
+    d->count = 0;
+}
+
+static struct dcache_entry **dcache_bucket(struct dcache *d, uint32_t parent,
+                                           const char *name, int len)
+{
+    uint64_t h = parent * 0x9e3779b97f4a7c15ull;
+    int i;
+
+    // FNV-1a over the name.
+    for (i = 0; i < len; i++)
+        h = (h ^ (uint8_t)name[i]) * 0x100000001b3ull;
+
+    return &d->hash[(h ^ (h >> 32)) & (d->hash_size - 1)];
+}
+
+static void dcache_lru_unlink(struct dcache *d, struct dcache_entry *de)
+{
+    if (de->prev)
+        de->prev->next = de->next;
+    else
+        d->head = de->next;
+    if (de->next)
+        de->next->prev = de->prev;
+    else
+        d->tail = de->prev;
+}
+
+static void dcache_lru_push(struct dcache *d, struct dcache_entry *de)
+{
+    de->prev = NULL;
+    de->next = d->head;
+    if (d->head)
+        d->head->prev = de;
+    else
+        d->tail = de;
+    d->head = de;
+}
+
+/* returns true if (parent, name) is cached. '*inode_index' is 0 for names
+ * known not to exist.
+ */
+static bool dcache_lookup(struct ext4fs *e, uint32_t parent, const char *name, uint32_t *inode_index)
+{
+    struct dcache *d = &e->dcache;
+    struct dcache_entry *de;
+    int len = strlen(name);
+
+    if (!d->hash)
+        return false;
+
+    pthread_mutex_lock(&d->lock);
+    for (de = *dcache_bucket(d, parent, name, len); de; de = de->hnext)
+        if (de->parent == parent && de->name_len == len && !memcmp(de->name, name, len))
+            break;
+
+    if (de)
+    {
+        d->hits++;
+        *inode_index = de->inode_index;
+        if (d->head != de)
+        {
+            dcache_lru_unlink(d, de);
+            dcache_lru_push(d, de);
+        }
+    }
+    else
+        d->misses++;
+    pthread_mutex_unlock(&d->lock);
+
+    return !!de;
+}
+
+static void dcache_insert(struct ext4fs *e, uint32_t parent, const char *name, uint32_t inode_index)
+{
+    struct dcache *d = &e->dcache;
+    struct dcache_entry *de, **bucket;
+    int len = strlen(name);
+
+    if (!d->hash || len > 255)
+        return;
+
+    de = malloc(sizeof(*de) + len);
+    if (!de)
+        fatal("no mem for dentry.\n");
+    de->parent = parent;
+    de->inode_index = inode_index;
+    de->name_len = len;
+    memcpy(de->name, name, len);
+
+    pthread_mutex_lock(&d->lock);
+
+    bucket = dcache_bucket(d, parent, name, len);
+    for (struct dcache_entry *old = *bucket; old; old = old->hnext)
+        if (old->parent == parent && old->name_len == len && !memcmp(old->name, name, len))
+        {
+            // inserted by someone else meanwhile.
+            pthread_mutex_unlock(&d->lock);
+            free(de);
+            return;
+        }
+
+    while (d->count >= d->max)
+    {
+        struct dcache_entry *victim = d->tail;
+        struct dcache_entry **pp;
+
+        for (pp = dcache_bucket(d, victim->parent, victim->name, victim->name_len);
+             *pp != victim; pp = &(*pp)->hnext)
+            ;
+        *pp = victim->hnext;
+        dcache_lru_unlink(d, victim);
+        d->count--;
+        free(victim);
+    }
+
+    de->hnext = *bucket;
+    *bucket = de;
+    dcache_lru_push(d, de);
+    d->count++;
+
+    pthread_mutex_unlock(&d->lock);
+}
+
+struct ext4fs *ext4fs_new(void *priv)
+{
+    struct ext4fs *e;
+
+    e = calloc(1, sizeof(*e));
+    if (!e)
+        return NULL;
+
+    e->priv = priv;
+    e->cache.size = CACHE_DEFAULT_SIZE;
+    e->dcache.max = DCACHE_DEFAULT_ENTRIES;
+    e->journal_replay = true;
+    pthread_mutex_init(&e->dcache.lock, NULL);
+    pthread_mutex_init(&e->bg_lock, NULL);
+
+    return e;
+}
+
+static void bg_free(struct ext4fs *e)
+{
+    uint32_t i;
+
+    if (!e->bg_chunk)
+        return;
+    for (i = 0; i < e->bg_chunk_count; i++)
+        free(e->bg_chunk[i]);
+    free(e->bg_chunk);
+    e->bg_chunk = NULL;
+}
+
+static void journal_free(struct ext4fs *e)
+{
+    uint32_t i;
+
+    for (i = 0; i < e->journal_count; i++)
+        free(e->journal[i].data);
+    free(e->journal);
+    e->journal = NULL;
+    e->journal_count = 0;
+}
+
+void ext4fs_del(struct ext4fs *e)
+{
+    cache_free(e);
+    dcache_free(e);
+    pthread_mutex_destroy(&e->dcache.lock);
+    bg_free(e);
+    pthread_mutex_destroy(&e->bg_lock);
+    journal_free(e);
+    free(e);
+}
+
+// first replayed block at or after 'blk'.
+static uint32_t journal_first(struct ext4fs *e, uint64_t blk)
+{
+    uint32_t lo = 0, hi = e->journal_count;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (e->journal[mid].blk < blk)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// whether image range has blocks replayed from the journal.
+static bool journal_overlaps(struct ext4fs *e, uint64_t offs, uint64_t size)
+{
+    uint32_t i;
+
+    if (e->journal_count == 0 || size == 0)
+        return false;
+
+    i = journal_first(e, offs / e->block_size);
+    return i < e->journal_count && e->journal[i].blk * e->block_size < offs + size;
+}
+
+static void readv_image(struct ext4fs *e, const struct ext4fs_read_req *req, uint32_t count)
+{
+    uint64_t bytes = 0;
+    uint32_t i;
+
+    if (count == 0)
+        return;
+
+    for (i = 0; i < count; i++)
+        bytes += req[i].size;
+
+    if (e->readv_cb)
+    {
+        count_reads(e, 1, count, bytes);
+        e->readv_cb(e->priv, req, count);
+        return;
+    }
+
+    count_reads(e, count, count, bytes);
+
+    for (i = 0; i < count; i++)
+        e->read_cb(e->priv, req[i].offs, req[i].data, req[i].size);
+}
+
+/* requests are split at blocks replayed from the journal. those parts are read
+ * from the journal instead, or copied from escaped blocks in memory.
+ */
+static void journal_readv(struct ext4fs *e, const struct ext4fs_read_req *req, uint32_t count)
+{
+    struct ext4fs_read_req *jreq = NULL;
+    uint32_t jcount = 0, jmax = 0;
+    uint32_t i, j;
+
+    for (i = 0; i < count; i++)
+    {
+        uint64_t offs = req[i].offs, end = req[i].offs + req[i].size;
+
+        for (j = journal_first(e, offs / e->block_size); offs < end;)
+        {
+            const struct journal_block *jb = j < e->journal_count ? &e->journal[j] : NULL;
+            uint64_t jb_offs = jb ? jb->blk * e->block_size : UINT64_MAX;
+            void *data = req[i].data + (offs - req[i].offs);
+            uint64_t len, phys;
+
+            if (jb_offs > offs)
+            {
+                len = (jb_offs < end ? jb_offs : end) - offs;
+                phys = offs;
+            }
+            else
+            {
+                len = e->block_size - (offs - jb_offs);
+                if (len > end - offs)
+                    len = end - offs;
+                phys = jb->phys * e->block_size + (offs - jb_offs);
+                j++;
+                if (jb->data)
+                {
+                    memcpy(data, jb->data + (offs - jb_offs), len);
+                    offs += len;
+                    continue;
+                }
+            }
+
+            if (jcount == jmax)
+            {
+                jmax = jmax ? jmax * 2 : 16;
+                jreq = realloc(jreq, jmax * sizeof(jreq[0]));
+                if (!jreq)
+                    fatal("no mem for read requests. %u\n", jmax);
+            }
+            jreq[jcount].offs = phys;
+            jreq[jcount].data = data;
+            jreq[jcount].size = len;
+            jcount++;
+            offs += len;
+        }
+    }
+
+    readv_image(e, jreq, jcount);
+    free(jreq);
+}
+
+// read bypassing block cache. used for file contents.
+static void do_read_uncached(struct ext4fs *e, uint64_t offs, void *data, uint32_t size)
+{
+    if (journal_overlaps(e, offs, size))
+    {
+        struct ext4fs_read_req req = {.offs = offs, .data = data, .size = size};
+
+        journal_readv(e, &req, 1);
+        return;
+    }
+
+    count_reads(e, 1, 1, size);
+    e->read_cb(e->priv, offs, data, size);
+}
+
+// batched read bypassing block cache.
+static void do_readv_uncached(struct ext4fs *e, const struct ext4fs_read_req *req, uint32_t count)
+{
+    uint32_t i;
+
+    for (i = 0; i < count && e->journal_count; i++)
+    {
+        if (journal_overlaps(e, req[i].offs, req[i].size))
+        {
+            journal_readv(e, req, count);
+            return;
+        }
+    }
+
+    readv_image(e, req, count);
+}
+
+// borrow_cb(), unless the range has blocks replayed from the journal.
+static const void *borrow(struct ext4fs *e, uint64_t offs, uint32_t size)
+{
+    if (!e->borrow_cb || journal_overlaps(e, offs, size))
+        return NULL;
+
+    return e->borrow_cb(e->priv, offs, size);
+}
+
+/* copy part of block 'blk' through the cache. reads whole block on miss.
+ * returns true if the part had its checksum verified.
+ */
+static bool cache_read(struct ext4fs *e, uint64_t blk, uint32_t offset_in_block,
+                       void *data, uint32_t size)
+{
+    struct cache_entry *ce;
+    bool checked = false;
+
+    if (cache_copy(e, blk, offset_in_block, data, size, true, &checked))
+        return checked;
+
+    ce = cache_alloc(e, blk);
+    do_read_uncached(e, blk * e->block_size, ce->data, e->block_size);
+    memcpy(data, ce->data + offset_in_block, size);
+    cache_insert(e, ce);
+
+    return false;
+}
+
+static int cmp_cache_entry(const void *a, const void *b)
+{
+    const struct cache_entry *x = *(struct cache_entry *const *)a;
+    const struct cache_entry *y = *(struct cache_entry *const *)b;
+
+    return x->blk < y->blk ? -1 : x->blk > y->blk;
+}
+
+static struct cache_entry *find_cache_entry(struct cache_entry **ces, uint32_t count, uint64_t blk)
+{
+    struct cache_entry key = {.blk = blk};
+    struct cache_entry *k = &key;
+    struct cache_entry **found;
+
+    found = bsearch(&k, ces, count, sizeof(ces[0]), cmp_cache_entry);
+
+    return found ? *found : NULL;
+}
+
+/* batched read through block cache.
+ *
+ * cached pieces are copied first. all missing blocks are then read with one
+ * batch, copied out and inserted into the cache.
+ */
+static void do_readv(struct ext4fs *e, const struct ext4fs_read_req *req, uint32_t count)
+{
+    struct cache_entry **miss = NULL;
+    struct ext4fs_read_req *miss_req;
+    uint32_t miss_count = 0, miss_max = 0;
+    uint32_t i, n;
+
+    if (!e->cache.enabled)
+    {
+        do_readv_uncached(e, req, count);
+        return;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        uint64_t offs;
+
+        for (offs = req[i].offs; offs < req[i].offs + req[i].size;)
+        {
+            uint64_t blk = offs / e->block_size;
+            uint32_t offset_in_block = offs % e->block_size;
+            uint32_t len = e->block_size - offset_in_block;
+
+            if (len > req[i].offs + req[i].size - offs)
+                len = req[i].offs + req[i].size - offs;
+
+            if (!cache_copy(e, blk, offset_in_block, req[i].data + (offs - req[i].offs), len, false, NULL))
+            {
+                if (miss_count == miss_max)
+                {
+                    miss_max = miss_max ? miss_max * 2 : 64;
+                    miss = realloc(miss, miss_max * sizeof(miss[0]));
+                    if (!miss)
+                        fatal("no mem for missing blocks. %u\n", miss_max);
+                }
+                miss[miss_count++] = cache_alloc(e, blk);
+            }
+
+            offs += len;
+        }
+    }
+
+    if (miss_count == 0)
+        return;
+
+    // same block can be missed by several requests. read it once.
+    qsort(miss, miss_count, sizeof(miss[0]), cmp_cache_entry);
+    cache_count(e, miss[0]->blk, false);
+    for (i = 1, n = 1; i < miss_count; i++)
+    {
+        if (miss[i]->blk == miss[n - 1]->blk)
+        {
+            cache_count(e, miss[i]->blk, true);
+            free(miss[i]);
+        }
+        else
+        {
+            cache_count(e, miss[i]->blk, false);
+            miss[n++] = miss[i];
+        }
+    }
+    miss_count = n;
+
+    miss_req = malloc(miss_count * sizeof(miss_req[0]));
+    if (!miss_req)
+        fatal("no mem for read requests. %u\n", miss_count);
+    for (i = 0; i < miss_count; i++)
+    {
+        miss_req[i].offs = miss[i]->blk * e->block_size;
+        miss_req[i].data = miss[i]->data;
+        miss_req[i].size = e->block_size;
+    }
+    do_readv_uncached(e, miss_req, miss_count);
+    free(miss_req);
+
+    for (i = 0; i < count; i++)
+    {
+        uint64_t offs;
+
+        for (offs = req[i].offs; offs < req[i].offs + req[i].size;)
+        {
+            uint64_t blk = offs / e->block_size;
+            uint32_t offset_in_block = offs % e->block_size;
+            uint32_t len = e->block_size - offset_in_block;
+            struct cache_entry *ce;
+
+            if (len > req[i].offs + req[i].size - offs)
+                len = req[i].offs + req[i].size - offs;
+
+            ce = find_cache_entry(miss, miss_count, blk);
+            if (ce)
+                memcpy(req[i].data + (offs - req[i].offs), ce->data + offset_in_block, len);
+
+            offs += len;
+        }
+    }
+
+    for (i = 0; i < miss_count; i++)
+        cache_insert(e, miss[i]);
+    free(miss);
+}
+
+static void do_read(struct ext4fs *e, uint64_t offs, void *data, uint32_t size)
+{
+    if (!e->cache.enabled)
+    {
+        do_read_uncached(e, offs, data, size);
+        return;
+    }
+
+    while (size)
+    {
+        uint64_t blk = offs / e->block_size;
+        uint32_t offset_in_block = offs % e->block_size;
+        uint32_t len = e->block_size - offset_in_block;
+
+        if (len > size)
+            len = size;
+
+        cache_read(e, blk, offset_in_block, data, len);
+
+        offs += len;
+        data += len;
+        size -= len;
+    }
+}
+
+/* returns pointer to image data at 'offs'.
+ *
+ * if the image can lend its memory, the returned pointer points into the image
+ * and 'buf' is not touched. otherwise data is read into 'buf' and 'buf' is
+ * returned.
+ */
+static const void *read_ptr(struct ext4fs *e, uint64_t offs, void *buf, uint32_t size)
+{
+    const void *p;
+
+    p = borrow(e, offs, size);
+    if (p)
+        return p;
+
+    do_read(e, offs, buf, size);
+    return buf;
+}
+
+/* crc32c of metadata_csum.
+ *
+ * the crc32 instruction is used if the cpu has it, checked at run time.
+ * otherwise tables of slicing-by-8. like the kernel's crc32c_le(), 'crc' is
+ * neither inverted at start nor at end.
+ */
+#define CRC32C_POLY 0x82f63b78 // reversed Castagnoli
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_impl)(uint32_t crc, const void *data, size_t size);
+static const char *crc32c_name;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_sw(uint32_t crc, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+
+    for (; size && ((uintptr_t)p & 7); size--)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        uint32_t lo, hi;
+
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+    }
+
+    while (size--)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(uint32_t crc, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    uint64_t c;
+
+    for (; size && ((uintptr_t)p & 7); size--)
+        crc = _mm_crc32_u8(crc, *p++);
+
+    for (c = crc; size >= 8; size -= 8, p += 8)
+    {
+        uint64_t v;
+
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+
+    for (crc = c; size; size--)
+        crc = _mm_crc32_u8(crc, *p++);
+
+    return crc;
+}
+
+static bool crc32c_hw_supported(void)
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+
+__attribute__((target("+crc"))) static uint32_t crc32c_hw(uint32_t crc, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+
+    for (; size && ((uintptr_t)p & 7); size--)
+        crc = __crc32cb(crc, *p++);
+
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        uint64_t v;
+
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+    }
+
+    for (; size; size--)
+        crc = __crc32cb(crc, *p++);
+
+    return crc;
+}
+
+static bool crc32c_hw_supported(void)
+{
+    return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+}
+#endif
+
+static void crc32c_init(void)
+{
+    uint32_t i, k;
+
+    for (i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+
+        for (k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+        for (k = 1; k < 8; k++)
+            crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^
+                                 crc32c_table[0][crc32c_table[k - 1][i] & 0xff];
+
+    crc32c_impl = crc32c_sw;
+    crc32c_name = "slicing-by-8";
+#if defined(__x86_64__) || defined(__aarch64__)
+    if (crc32c_hw_supported())
+    {
+        crc32c_impl = crc32c_hw;
+        crc32c_name = "crc32 instruction";
+    }
+#endif
+}
+
+static uint32_t crc32c(uint32_t crc, const void *data, size_t size)
+{
+    return crc32c_impl(crc, data, size);
+}
+
+/* set bits of bitmaps.
+ *
+ * with avx2, nibbles are counted by table lookup in 32 byte vectors and
+ * summed per 8 bytes. otherwise by 64 bit words.
+ */
+static uint64_t (*popcount_impl)(const uint8_t *data, size_t size);
+static const char *popcount_name;
+static pthread_once_t popcount_once = PTHREAD_ONCE_INIT;
+
+static uint64_t popcount_sw(const uint8_t *data, size_t size)
+{
+    uint64_t count = 0;
+
+    for (; size >= 8; size -= 8, data += 8)
+    {
+        uint64_t v;
+
+        memcpy(&v, data, 8);
+        count += __builtin_popcountll(v);
+    }
+    for (; size; size--)
+        count += __builtin_popcount(*data++);
+
+    return count;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static uint64_t popcount_hw(const uint8_t *data, size_t size)
+{
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i sum = _mm256_setzero_si256();
+    uint64_t count;
+
+    for (; size >= 32; size -= 32, data += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)data);
+        __m256i n = _mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(v, low)),
+                                    _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(n, _mm256_setzero_si256()));
+    }
+    count = _mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1) +
+            _mm256_extract_epi64(sum, 2) + _mm256_extract_epi64(sum, 3);
+
+    return count + popcount_sw(data, size);
+}
+#endif
+
+static void popcount_init(void)
+{
+    popcount_impl = popcount_sw;
+    popcount_name = "64 bit words";
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        popcount_impl = popcount_hw;
+        popcount_name = "avx2";
+    }
+#endif
+}
+
+// set bits in first 'nbits' of 'bitmap'.
+static uint64_t popcount(const uint8_t *bitmap, uint32_t nbits)
+{
+    uint64_t count;
+
+    pthread_once(&popcount_once, popcount_init);
+    count = popcount_impl(bitmap, nbits / 8);
+    if (nbits % 8)
+        count += __builtin_popcount(bitmap[nbits / 8] & ((1 << (nbits % 8)) - 1));
+
+    return count;
+}
+
+// seed of checksums of an inode and the blocks it owns.
+static uint32_t inode_csum_seed(struct ext4fs *e, uint32_t inode_index, uint32_t generation)
+{
+    uint32_t csum;
+
+    if (!e->csum)
+        return 0;
+
+    csum = crc32c(e->csum_seed, &inode_index, sizeof(inode_index));
+    return crc32c(csum, &generation, sizeof(generation));
+}
+
+/* returns true if checksum of 'size' bytes of metadata 'data' is right. 'arg'
+ * is what the checksum depends on besides the data, per structure.
+ */
+typedef bool (*csum_check_t)(struct ext4fs *e, const void *data, uint32_t size, uint32_t arg);
+
+// computes checksum. the result is remembered if 'data' is in the block cache.
+static void csum_compute(struct ext4fs *e, uint64_t offs, const void *data, uint32_t size, bool cached,
+                         csum_check_t check, uint32_t arg, const char *what)
+{
+    __atomic_add_fetch(&e->csum_checks, 1, __ATOMIC_RELAXED);
+    if (!check(e, data, size, arg))
+        fatal("%s checksum error at 0x%llx, %u bytes.\n", what, (long long)offs, size);
+
+    if (cached)
+        cache_checked(e, offs / e->block_size, offs % e->block_size, size, true);
+}
+
+/* verifies metadata 'data' read from 'offs', if checksums are enabled. 'cached'
+ * is true if it was read through do_read(), so the result can be remembered
+ * by the block cache.
+ */
+static void csum_verify(struct ext4fs *e, uint64_t offs, const void *data, uint32_t size, bool cached,
+                        csum_check_t check, uint32_t arg, const char *what)
+{
+    uint32_t offset_in_block = offs % e->block_size;
+
+    if (!e->csum)
+        return;
+
+    cached = cached && e->cache.enabled && offset_in_block + size <= e->block_size;
+    if (cached && cache_checked(e, offs / e->block_size, offset_in_block, size, false))
+    {
+        __atomic_add_fetch(&e->csum_cached, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    csum_compute(e, offs, data, size, cached, check, arg, what);
+}
+
+// read_ptr() and csum_verify().
+static const void *read_checked(struct ext4fs *e, uint64_t offs, void *buf, uint32_t size,
+                                csum_check_t check, uint32_t arg, const char *what)
+{
+    uint32_t offset_in_block = offs % e->block_size;
+    const void *p;
+
+    // one cache lookup for the data and whether it was verified.
+    if (e->csum && !e->borrow_cb && e->cache.enabled && offset_in_block + size <= e->block_size)
+    {
+        if (cache_read(e, offs / e->block_size, offset_in_block, buf, size))
+            __atomic_add_fetch(&e->csum_cached, 1, __ATOMIC_RELAXED);
+        else
+            csum_compute(e, offs, buf, size, true, check, arg, what);
+        return buf;
+    }
+
+    p = read_ptr(e, offs, buf, size);
+    csum_verify(e, offs, p, size, p == buf, check, arg, what);
+    return p;
+}
+
+static char *arr2str(struct ext4fs *e, void *ptr, int i, int total, int esize)
+{
+    char *s;
+    uint64_t d = 0;
+    int r;
+
+    switch (esize)
+    {
+    case 1:
+        d = *(uint8_t *)(ptr + i * esize);
+        break;
+    case 2:
+        d = *(uint16_t *)(ptr + i * esize);
+        break;
+    case 4:
+        d = *(uint32_t *)(ptr + i * esize);
+        break;
+    case 8:
+        d = *(uint64_t *)(ptr + i * esize);
+        break;
+    default:
+        fatal("unknown esize. %d\n", esize);
+    }
+
+    if (i + 1 != total)
+    {
+        char *n = arr2str(e, ptr, i + 1, total, esize);
+        r = asprintf(&s, "%0*llx %s", esize * 2, (long long)d, n);
+        free(n);
+    }
+    else
+        r = asprintf(&s, "%0*llx", esize * 2, (long long)d);
+
+    if (r < 0)
+        fatal("asprintf() failed.\n");
+
+    return s;
+}
+
+static bool is_64bit(struct ext4fs *e)
+{
+    return !!(e->sb.s_feature_incompat & EXT4_FEATURE_COMPAT_64BIT);
+}
+
+static void dump_sb(struct ext4fs *e)
+{
+#define print_sb_(m) dump("(%03x) %-28s= 0x%0*llx(%llu)\n",             \
+                          (int)(long)&((struct super_block *)NULL)->m,  \
+                          #m, sizeof(e->sb.m) * 2,                      \
+                          (long long)e->sb.m, (long long)e->sb.m)
+#define print_sbs(m) dump("(%03x) %-28s= \"%s\"\n",                        \
+                          (int)(long)&((struct super_block *)NULL)->m[0],  \
+                          #m, e->sb.m)
+#define print_sba(m)                                          \
+    do                                                        \
+    {                                                         \
+        char *s;                                              \
+        s = arr2str(e, e->sb.m,                               \
+                    0, sizeof(e->sb.m) / sizeof(e->sb.m[0]),  \
+                    sizeof(e->sb.m[0]));                      \
+        dump("(%03x) %-28s= %s\n",                            \
+             (int)(long)&((struct super_block *)NULL)->m[0],  \
+             #m, s);                                          \
+        free(s);                                              \
+    } while (0)
+    print_sb_(s_inodes_count);
+    print_sb_(s_blocks_count_lo);
+    print_sb_(s_r_blocks_count_lo);
+    print_sb_(s_free_blocks_count_lo);
+    print_sb_(s_free_inodes_count);
+    print_sb_(s_first_data_block);
+    print_sb_(s_log_block_size);
+    print_sb_(s_log_cluster_size);
+    print_sb_(s_blocks_per_group);
+    print_sb_(s_clusters_per_group);
+    print_sb_(s_inodes_per_group);
+    print_sb_(s_mtime);
+    print_sb_(s_wtime);
+    print_sb_(s_mnt_count);
+    print_sb_(s_max_mnt_count);
+    print_sb_(s_magic);
+    print_sb_(s_state);
+    print_sb_(s_errors);
+    print_sb_(s_minor_rev_level);
+    print_sb_(s_lastcheck);
+    print_sb_(s_checkinterval);
+    print_sb_(s_creator_os);
+    print_sb_(s_rev_level);
+    print_sb_(s_def_resuid);
+    print_sb_(s_def_resgid);
+    print_sb_(s_first_ino);
+    print_sb_(s_inode_size);
+    print_sb_(s_block_group_nr);
+    print_sb_(s_feature_compat);
+    print_sb_(s_feature_incompat);
+    print_sb_(s_feature_ro_compat);
+    print_sba(s_uuid);
+    print_sbs(s_volume_name);
+    print_sbs(s_last_mounted);
+    print_sb_(s_algorithm_usage_bitmap);
+    print_sb_(s_prealloc_blocks);
+    print_sb_(s_prealloc_dir_blocks);
+    print_sb_(s_reserved_gdt_blocks);
+    print_sba(s_journal_uuid);
+    print_sb_(s_journal_inum);
+    print_sb_(s_journal_dev);
+    print_sb_(s_last_orphan);
+    print_sba(s_hash_seed);
+    print_sb_(s_def_hash_version);
+    print_sb_(s_jnl_backup_type);
+    print_sb_(s_desc_size);
+    print_sb_(s_default_mount_opts);
+    print_sb_(s_first_meta_bg);
+    print_sb_(s_mkfs_time);
+    print_sba(s_jnl_blocks);
+    if (is_64bit(e))
+    {
+        print_sb_(s_blocks_count_hi);
+        print_sb_(s_r_blocks_count_hi);
+        print_sb_(s_free_blocks_count_hi);
+        print_sb_(s_min_extra_isize);
+        print_sb_(s_want_extra_isize);
+        print_sb_(s_flags);
+        print_sb_(s_raid_stride);
+        print_sb_(s_mmp_interval);
+        print_sb_(s_mmp_block);
+        print_sb_(s_raid_stripe_width);
+        print_sb_(s_log_groups_per_flex);
+        print_sb_(s_checksum_type);
+        print_sb_(s_reserved_pad);
+        print_sb_(s_kbytes_written);
+        print_sb_(s_snapshot_inum);
+        print_sb_(s_snapshot_id);
+        print_sb_(s_snapshot_r_blocks_count);
+        print_sb_(s_snapshot_list);
+        print_sb_(s_error_count);
+        print_sb_(s_first_error_time);
+        print_sb_(s_first_error_ino);
+        print_sb_(s_first_error_block);
+        print_sbs(s_first_error_func);
+        print_sb_(s_first_error_line);
+        print_sb_(s_last_error_time);
+        print_sb_(s_last_error_ino);
+        print_sb_(s_last_error_line);
+        print_sb_(s_last_error_block);
+        print_sbs(s_last_error_func);
+        print_sbs(s_mount_opts);
+        print_sb_(s_usr_quota_inum);
+        print_sb_(s_grp_quota_inum);
+        print_sb_(s_overhead_blocks);
+        print_sba(s_backup_bgs);
+        print_sba(s_encrypt_algos);
+        print_sba(s_encrypt_pw_salt);
+        print_sb_(s_lpf_ino);
+        print_sb_(s_prj_quota_inum);
+        print_sb_(s_checksum_seed);
+        // print_sb_(s_reserved[98]);
+        print_sb_(s_checksum);
+    }
+#undef print_sb_
+#undef print_sbs
+#undef print_sba
+}
+
+static bool csum_sb(struct ext4fs *e, const void *data, uint32_t size, uint32_t arg)
+{
+    const struct super_block *sb = data;
+
+    return crc32c(~0u, sb, offsetof(struct super_block, s_checksum)) == sb->s_checksum;
+}
+
+// only metadata_csum is checked. crc16 of gdt_csum is not.
+static void csum_init(struct ext4fs *e)
+{
+    if (!(e->sb.s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_METADATA_CSUM))
+    {
+        debug("no metadata checksums.\n");
+        return;
+    }
+    if (e->sb.s_checksum_type != EXT4_CRC32C_CHKSUM)
+        fatal("unknown checksum type. %u\n", e->sb.s_checksum_type);
+
+    pthread_once(&crc32c_once, crc32c_init);
+    e->csum = true;
+    if (e->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_CSUM_SEED)
+        e->csum_seed = e->sb.s_checksum_seed;
+    else
+        e->csum_seed = crc32c(~0u, e->sb.s_uuid, sizeof(e->sb.s_uuid));
+    debug("metadata checksums. crc32c with %s\n", crc32c_name);
+
+    csum_verify(e, 0x400, &e->sb, sizeof(e->sb), false, csum_sb, 0, "superblock");
+}
+
+static void read_sb(struct ext4fs *e)
+{
+    if (sizeof(e->sb) != 0x400)
+        fatal("sizeof(sb) is not 0x400. %d\n", sizeof(e->sb));
+    do_read(e, 0x400, &e->sb, sizeof(e->sb));
+
+    if (log_enabled(EXT4FS_LOG_DUMP))
+        dump_sb(e);
+
+    if (e->sb.s_magic != 0xef53)
+        fatal("wrong magic. 0x%04x\n", e->sb.s_magic);
+
+    e->block_size = 1 << (10 + e->sb.s_log_block_size);
+    debug("block size %u\n", e->block_size);
+    debug("inode size %u\n", e->sb.s_inode_size);
+    debug("64bit filesystem %d\n", is_64bit(e));
+
+    if (e->verify)
+        csum_init(e);
+}
+
+#define get64(m) ((((uint64_t)m##_hi) << 32) | ((uint64_t)m##_lo))
+
+static bool is_power_of(uint32_t n, uint32_t base)
+{
+    while (n > 1 && n % base == 0)
+        n /= base;
+    return n == 1;
+}
+
+static bool bg_has_super(struct ext4fs *e, uint32_t group)
+{
+    if (group == 0)
+        return true;
+    if (e->sb.s_feature_compat & EXT4_FEATURE_COMPAT_SPARSE_SUPER2)
+        return group == e->sb.s_backup_bgs[0] || group == e->sb.s_backup_bgs[1];
+    if (group == 1 || !(e->sb.s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER))
+        return true;
+    return is_power_of(group, 3) || is_power_of(group, 5) || is_power_of(group, 7);
+}
+
+// block number of 'nr'th descriptor block.
+static uint64_t bg_desc_block(struct ext4fs *e, uint32_t nr)
+{
+    uint32_t group;
+
+    if (!(e->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_META_BG) ||
+        nr < e->sb.s_first_meta_bg)
+        return e->sb.s_first_data_block + nr + 1;
+
+    // with meta_bg, each meta group keeps its descriptors in its first group.
+    group = nr * e->bg_per_block;
+    return (uint64_t)group * e->sb.s_blocks_per_group + e->sb.s_first_data_block +
+           bg_has_super(e, group);
+}
+
+static void bg_init(struct ext4fs *e)
+{
+    uint32_t desc_blocks;
+
+    e->bg_count = e->sb.s_inodes_count / e->sb.s_inodes_per_group;
+    e->bg_desc_size = is_64bit(e) ? e->sb.s_desc_size : 32;
+    if (e->bg_desc_size < 32 || e->bg_desc_size > e->block_size)
+        fatal("invalid descriptor size. %u\n", e->bg_desc_size);
+    e->bg_per_block = e->block_size / e->bg_desc_size;
+
+    desc_blocks = (e->bg_count + e->bg_per_block - 1) / e->bg_per_block;
+    e->bg_chunk_count = (desc_blocks + BG_CHUNK_BLOCKS - 1) / BG_CHUNK_BLOCKS;
+    debug("block group descriptors %u, %u blocks\n", e->bg_count, desc_blocks);
+
+    e->bg_chunk = calloc(e->bg_chunk_count, sizeof(e->bg_chunk[0]));
+    if (!e->bg_chunk)
+        fatal("no mem for block group. %u\n", e->bg_chunk_count);
+}
+
+static void decode_bg(struct ext4fs *e, uint32_t group, const void *raw, struct bg_info *bg)
+{
+    struct group_desc gd = {};
+
+    memcpy(&gd, raw, e->bg_desc_size < sizeof(gd) ? e->bg_desc_size : sizeof(gd));
+
+#define print_bg(m) dump("(%02x) bg[%d].%-28s= 0x%0*llx(%llu)\n",     \
+                         (int)(long)&((struct group_desc *)NULL)->m,  \
+                         group, #m,                                   \
+                         sizeof(gd.m) * 2,                            \
+                         (long long)gd.m, (long long)gd.m)
+    print_bg(bg_block_bitmap_lo);
+    print_bg(bg_inode_bitmap_lo);
+    print_bg(bg_inode_table_lo);
+    print_bg(bg_free_blocks_count_lo);
+    print_bg(bg_free_inodes_count_lo);
+    print_bg(bg_used_dirs_count_lo);
+    print_bg(bg_flags);
+    print_bg(bg_exclude_bitmap_lo);
+    print_bg(bg_block_bitmap_csum_lo);
+    print_bg(bg_inode_bitmap_csum_lo);
+    print_bg(bg_itable_unused_lo);
+    print_bg(bg_checksum);
+    if (e->bg_desc_size >= sizeof(gd))
+    {
+        print_bg(bg_block_bitmap_hi);
+        print_bg(bg_inode_bitmap_hi);
+        print_bg(bg_inode_table_hi);
+        print_bg(bg_free_blocks_count_hi);
+        print_bg(bg_free_inodes_count_hi);
+        print_bg(bg_used_dirs_count_hi);
+        print_bg(bg_itable_unused_hi);
+        print_bg(bg_exclude_bitmap_hi);
+        print_bg(bg_block_bitmap_csum_hi);
+        print_bg(bg_inode_bitmap_csum_hi);
+        // print_bg(bg_reserved);
+    }
+#undef print_bg
+
+    // 'hi' halves are zero without 64bit.
+    bg->block_bitmap = get64(gd.bg_block_bitmap);
+    bg->inode_bitmap = get64(gd.bg_inode_bitmap);
+    bg->inode_table = get64(gd.bg_inode_table);
+    bg->free_blocks_count = ((uint32_t)gd.bg_free_blocks_count_hi << 16) | gd.bg_free_blocks_count_lo;
+    bg->free_inodes_count = ((uint32_t)gd.bg_free_inodes_count_hi << 16) | gd.bg_free_inodes_count_lo;
+    bg->used_dirs_count = ((uint32_t)gd.bg_used_dirs_count_hi << 16) | gd.bg_used_dirs_count_lo;
+    bg->itable_unused = ((uint32_t)gd.bg_itable_unused_hi << 16) | gd.bg_itable_unused_lo;
+    bg->flags = gd.bg_flags;
+}
+
+static bool csum_bg(struct ext4fs *e, const void *data, uint32_t size, uint32_t group)
+{
+    const struct group_desc *gd = data;
+    uint32_t offset = offsetof(struct group_desc, bg_checksum);
+    uint16_t zero = 0;
+    uint32_t csum;
+
+    csum = crc32c(e->csum_seed, &group, sizeof(group));
+    csum = crc32c(csum, data, offset);
+    csum = crc32c(csum, &zero, sizeof(zero));
+    offset += sizeof(zero);
+    if (size > offset)
+        csum = crc32c(csum, data + offset, size - offset);
+
+    return (csum & 0xffff) == gd->bg_checksum;
+}
+
+/* reads descriptor blocks of a chunk. contiguous blocks are read with one
+ * request, which is the whole chunk unless meta_bg scatters them.
+ */
+static struct bg_info *load_bg_chunk(struct ext4fs *e, uint32_t chunk)
+{
+    struct ext4fs_read_req req[BG_CHUNK_BLOCKS];
+    uint32_t groups_per_chunk = e->bg_per_block * BG_CHUNK_BLOCKS;
+    uint32_t first_group = chunk * groups_per_chunk;
+    uint32_t ngroups, nblocks, nreq = 0;
+    struct bg_info *bg;
+    uint8_t *buf;
+    uint32_t i;
+
+    ngroups = e->bg_count - first_group;
+    if (ngroups > groups_per_chunk)
+        ngroups = groups_per_chunk;
+    nblocks = (ngroups + e->bg_per_block - 1) / e->bg_per_block;
+
+    buf = malloc(nblocks * e->block_size);
+    bg = calloc(ngroups, sizeof(bg[0]));
+    if (!buf || !bg)
+        fatal("no mem for block group chunk. %u\n", ngroups);
+
+    for (i = 0; i < nblocks; i++)
+    {
+        uint64_t offs = bg_desc_block(e, chunk * BG_CHUNK_BLOCKS + i) * e->block_size;
+
+        if (nreq && req[nreq - 1].offs + req[nreq - 1].size == offs)
+        {
+            req[nreq - 1].size += e->block_size;
+            continue;
+        }
+        req[nreq].offs = offs;
+        req[nreq].data = buf + i * e->block_size;
+        req[nreq].size = e->block_size;
+        nreq++;
+    }
+    debug("block group chunk %u. groups %u..%u, %u requests\n",
+          chunk, first_group, first_group + ngroups, nreq);
+    do_readv_uncached(e, req, nreq);
+
+    for (i = 0; i < ngroups; i++)
+    {
+        uint32_t offset_in_chunk = (i / e->bg_per_block) * e->block_size +
+                                   (i % e->bg_per_block) * e->bg_desc_size;
+
+        csum_verify(e, bg_desc_block(e, chunk * BG_CHUNK_BLOCKS + i / e->bg_per_block) * e->block_size +
+                           offset_in_chunk % e->block_size,
+                    buf + offset_in_chunk, e->bg_desc_size, false, csum_bg, first_group + i,
+                    "group descriptor");
+        decode_bg(e, first_group + i, buf + offset_in_chunk, &bg[i]);
+    }
+    free(buf);
+
+    return bg;
+}
+
+static const struct bg_info *get_bg(struct ext4fs *e, uint32_t group)
+{
+    uint32_t groups_per_chunk = e->bg_per_block * BG_CHUNK_BLOCKS;
+    uint32_t chunk;
+    struct bg_info *bg;
+
+    if (group >= e->bg_count)
+        fatal("invalid block group. %u\n", group);
+
+    chunk = group / groups_per_chunk;
+    bg = __atomic_load_n(&e->bg_chunk[chunk], __ATOMIC_ACQUIRE);
+    if (!bg)
+    {
+        pthread_mutex_lock(&e->bg_lock);
+        bg = e->bg_chunk[chunk];
+        if (!bg)
+        {
+            bg = load_bg_chunk(e, chunk);
+            __atomic_store_n(&e->bg_chunk[chunk], bg, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&e->bg_lock);
+    }
+
+    return &bg[group % groups_per_chunk];
+}
+
+static uint64_t inode_offset(struct ext4fs *e, uint32_t inode_index)
+{
+    uint32_t group_index;
+    uint32_t index_in_group;
+    uint64_t offset;
+
+    inode_index--;
+    group_index = inode_index / e->sb.s_inodes_per_group;
+    index_in_group = inode_index % e->sb.s_inodes_per_group;
+
+    offset = get_bg(e, group_index)->inode_table * e->block_size;
+    offset += index_in_group * e->sb.s_inode_size;
+
+    return offset;
+}
+
+static void dump_inode(struct ext4fs *e, uint32_t inode_index, const struct inode *inode)
+{
+#define print_i__(m, f) dump("(%02x) inode[%d].%-28s= 0x%0*llx(" f ")\n",  \
+                             (int)(long)&((struct inode *)NULL)->m,        \
+                             inode_index, #m,                              \
+                             sizeof(inode->m) * 2,                         \
+                             (long long)inode->m, (long long)inode->m)
+#define print_i_(m) print_i__(m, "%llu")
 #define print_io(m) print_i__(m, "0%llo")
     print_io(i_mode);
     print_i_(i_uid);
@@ -537,433 +1981,4597 @@ static void read_inode(struct ext4fs *e, uint32_t inode_index, struct inode *ino
 #undef print_io
 }
 
-struct extent_header
+/* checksum of whole on-disk inode, with the checksum fields as zero. the
+ * upper half is there if i_extra_isize covers it.
+ */
+static bool csum_inode(struct ext4fs *e, const void *data, uint32_t size, uint32_t inode_index)
+{
+    const struct inode *inode = data;
+    uint32_t offset = offsetof(struct inode, l_i_checksum_lo);
+    uint32_t csum, want;
+    uint16_t zero = 0;
+    bool has_hi;
+
+    has_hi = size > EXT4_GOOD_OLD_INODE_SIZE &&
+             EXT4_GOOD_OLD_INODE_SIZE + inode->i_extra_isize >= offsetof(struct inode, i_ctime_extra);
+
+    csum = crc32c(inode_csum_seed(e, inode_index, inode->i_generation), data, offset);
+    csum = crc32c(csum, &zero, sizeof(zero));
+    offset += sizeof(zero);
+    csum = crc32c(csum, data + offset, EXT4_GOOD_OLD_INODE_SIZE - offset);
+    if (size > EXT4_GOOD_OLD_INODE_SIZE)
+    {
+        offset = offsetof(struct inode, i_checksum_hi);
+        csum = crc32c(csum, data + EXT4_GOOD_OLD_INODE_SIZE, offset - EXT4_GOOD_OLD_INODE_SIZE);
+        if (has_hi)
+        {
+            csum = crc32c(csum, &zero, sizeof(zero));
+            offset += sizeof(zero);
+        }
+        csum = crc32c(csum, data + offset, size - offset);
+    }
+
+    want = inode->l_i_checksum_lo;
+    if (has_hi)
+        want |= (uint32_t)inode->i_checksum_hi << 16;
+    else
+        csum &= 0xffff;
+    if (csum == want)
+        return true;
+
+    // never used inodes are zero.
+    for (offset = 0; offset < size; offset++)
+        if (((const uint8_t *)data)[offset])
+            return false;
+    return true;
+}
+
+/* returns the inode. it points into the image if the image can lend its
+ * memory, otherwise 'buf' is filled and returned.
+ */
+static const struct inode *read_inode(struct ext4fs *e, uint32_t inode_index, struct inode *buf)
+{
+    const struct inode *inode = buf;
+    uint64_t offset;
+    uint32_t inode_size;
+
+    offset = inode_offset(e, inode_index);
+    debug("inode[%d] offset 0x%08llx\n", inode_index, offset);
+
+    inode_size = e->sb.s_inode_size;
+    if (e->csum)
+    {
+        // checksum covers whole inode, which can be larger than 'buf'.
+        uint8_t raw[inode_size] __attribute__((aligned(8)));
+        const void *p;
+
+        p = read_checked(e, offset, raw, inode_size, csum_inode, inode_index, "inode");
+        if (p != raw && inode_size >= sizeof(*inode))
+            inode = p;
+        else
+            memcpy(buf, p, inode_size < sizeof(*buf) ? inode_size : sizeof(*buf));
+    }
+    else if (inode_size >= sizeof(*inode))
+        inode = read_ptr(e, offset, buf, sizeof(*inode));
+    else
+        do_read(e, offset, buf, inode_size);
+
+    if (log_enabled(EXT4FS_LOG_DUMP))
+        dump_inode(e, inode_index, inode);
+
+    return inode;
+}
+
+/* extended attributes in the inode, after i_extra_isize. entries are followed
+ * by 4 zero bytes. value offsets are from the first entry.
+ */
+#define EXT4_XATTR_MAGIC 0xEA020000
+#define EXT4_XATTR_INDEX_SYSTEM 7
+
+struct xattr_entry
+{
+    __u8 e_name_len;
+    __u8 e_name_index;
+    __le16 e_value_offs;
+    __le32 e_value_inum;
+    __le32 e_value_size;
+    __le32 e_hash;
+    char e_name[0];
+};
+
+// data kept in the inode. inline data, or target of a fast symlink.
+static bool inode_is_inline(const struct inode *inode)
+{
+    if (inode->i_flags & EXT4_INLINE_DATA_FL)
+        return true;
+
+    return (inode->i_mode & 0xf000) == S_IFLNK && get64(inode->i_size) < EXT4_MIN_INLINE_DATA_SIZE;
+}
+
+/* copies value of system.data xattr, inline data after i_block, to 'data'.
+ * returns its size. the inode table block is cached by read_inode(), so this
+ * does not read the image again.
+ */
+static uint32_t read_inline_xattr(struct ext4fs *e, uint32_t inode_index, const struct inode *inode,
+                                  void *data, uint32_t size)
+{
+    uint32_t start = EXT4_GOOD_OLD_INODE_SIZE + inode->i_extra_isize;
+    uint32_t len, off;
+    const uint8_t *p;
+
+    if (e->sb.s_inode_size <= EXT4_GOOD_OLD_INODE_SIZE || start + 4 > e->sb.s_inode_size)
+        return 0;
+    len = e->sb.s_inode_size - start;
+
+    uint8_t buf[len] __attribute__((aligned(8)));
+
+    p = read_ptr(e, inode_offset(e, inode_index) + start, buf, len);
+    if (*(const __le32 *)p != EXT4_XATTR_MAGIC)
+        return 0;
+    p += 4;
+    len -= 4;
+
+    for (off = 0; off + sizeof(struct xattr_entry) <= len && *(const __le32 *)(p + off);)
+    {
+        const struct xattr_entry *xe = (const void *)(p + off);
+
+        if (xe->e_name_index == EXT4_XATTR_INDEX_SYSTEM && xe->e_name_len == 4 &&
+            off + sizeof(*xe) + 4 <= len && !memcmp(xe->e_name, "data", 4))
+        {
+            if (xe->e_value_inum || xe->e_value_offs + (uint64_t)xe->e_value_size > len)
+                fatal("wrong inline data xattr of inode %u. offs %u, size %u\n",
+                      inode_index, xe->e_value_offs, xe->e_value_size);
+            memcpy(data, p + xe->e_value_offs, xe->e_value_size < size ? xe->e_value_size : size);
+            return xe->e_value_size;
+        }
+        off += (sizeof(*xe) + xe->e_name_len + 3) & ~3;
+    }
+
+    return 0;
+}
+
+// returns data kept in the inode, of i_size bytes.
+static void *read_inline(struct ext4fs *e, uint32_t inode_index, const struct inode *inode,
+                         uint64_t *size)
+{
+    uint64_t data_size = get64(inode->i_size);
+    uint32_t n = EXT4_MIN_INLINE_DATA_SIZE;
+    void *data;
+
+    if (data_size > EXT4_MIN_INLINE_DATA_SIZE + e->sb.s_inode_size)
+        fatal("wrong inline data size of inode %u. %llu\n", inode_index, (long long)data_size);
+
+    data = malloc(data_size ? data_size : 1);
+    if (!data)
+        fatal("no memory for inline data. %llu\n", (long long)data_size);
+
+    if (n > data_size)
+        n = data_size;
+    memcpy(data, inode->i_block, n);
+    if (data_size > n && read_inline_xattr(e, inode_index, inode, data + n, data_size - n) < data_size - n)
+        fatal("short inline data of inode %u. size %llu\n", inode_index, (long long)data_size);
+
+    *size = data_size;
+    return data;
+}
+
+#define INODE_SPAN_GAP (64 * 1024)          // inode table gap read through
+#define INODE_BATCH_SIZE (4 * 1024 * 1024)  // bytes read at once
+
+struct inode_order
+{
+    uint32_t inode_index;
+    uint32_t pos;
+};
+
+static int cmp_inode_order(const void *a, const void *b)
+{
+    const struct inode_order *x = a;
+    const struct inode_order *y = b;
+
+    if (x->inode_index != y->inode_index)
+        return x->inode_index < y->inode_index ? -1 : 1;
+    return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+/* reads 'count' inodes. 'inodes' should be zero filled.
+ *
+ * inodes are sorted by number, and the inode table blocks covering them are
+ * read with a few large requests, bypassing the block cache. close spans are
+ * merged, reading the gap between them.
+ */
+static void read_inodes(struct ext4fs *e, uint32_t count, const uint32_t *inode_index,
+                        struct inode *inodes)
+{
+    struct inode_order *order;
+    struct ext4fs_read_req *req;
+    uint32_t *span_first;
+    uint8_t *buf;
+    uint32_t inode_size;
+    uint32_t i;
+
+    if (count == 0)
+        return;
+
+    inode_size = e->sb.s_inode_size;
+    if (inode_size > sizeof(inodes[0]))
+        inode_size = sizeof(inodes[0]);
+
+    order = malloc(count * sizeof(order[0]));
+    if (!order)
+        fatal("no mem for inode order. %u\n", count);
+    for (i = 0; i < count; i++)
+    {
+        order[i].inode_index = inode_index[i];
+        order[i].pos = i;
+    }
+    qsort(order, count, sizeof(order[0]), cmp_inode_order);
+
+    if (e->borrow_cb)
+    {
+        // the image is in memory already.
+        uint8_t raw[e->sb.s_inode_size] __attribute__((aligned(8)));
+
+        for (i = 0; i < count; i++)
+        {
+            uint64_t offs = inode_offset(e, order[i].inode_index);
+            const void *p = read_ptr(e, offs, raw, e->sb.s_inode_size);
+
+            csum_verify(e, offs, p, e->sb.s_inode_size, p == raw, csum_inode, order[i].inode_index, "inode");
+            memcpy(&inodes[order[i].pos], p, inode_size);
+        }
+        goto dump;
+    }
+
+    req = malloc(count * sizeof(req[0]));
+    span_first = malloc((count + 1) * sizeof(span_first[0]));
+    buf = malloc(INODE_BATCH_SIZE);
+    if (!req || !span_first || !buf)
+        fatal("no mem for inode spans. %u\n", count);
+
+    i = 0;
+    while (i < count)
+    {
+        uint32_t nspan = 0;
+        uint32_t used = 0;
+        uint32_t s, j;
+
+        // builds spans until the buffer is full.
+        while (i < count)
+        {
+            uint64_t offs = inode_offset(e, order[i].inode_index);
+            uint64_t start = offs & ~(uint64_t)(e->block_size - 1);
+            uint64_t end = (offs + inode_size + e->block_size - 1) & ~(uint64_t)(e->block_size - 1);
+
+            if (nspan)
+            {
+                struct ext4fs_read_req *last = &req[nspan - 1];
+                uint64_t last_end = last->offs + last->size;
+
+                if (start >= last->offs && start <= last_end + INODE_SPAN_GAP &&
+                    used + (end > last_end ? end - last_end : 0) <= INODE_BATCH_SIZE)
+                {
+                    if (end > last_end)
+                    {
+                        used += end - last_end;
+                        last->size = end - last->offs;
+                    }
+                    i++;
+                    continue;
+                }
+            }
+
+            if (used + (end - start) > INODE_BATCH_SIZE)
+                break;
+
+            req[nspan].offs = start;
+            req[nspan].data = buf + used;
+            req[nspan].size = end - start;
+            span_first[nspan] = i;
+            nspan++;
+            used += end - start;
+            i++;
+        }
+        span_first[nspan] = i;
+
+        debug("inodes %u..%u, %u spans, %u bytes\n",
+              span_first[0], i, nspan, used);
+        do_readv_uncached(e, req, nspan);
+
+        for (s = 0; s < nspan; s++)
+            for (j = span_first[s]; j < span_first[s + 1]; j++)
+            {
+                uint64_t offs = inode_offset(e, order[j].inode_index);
+                const uint8_t *p = (uint8_t *)req[s].data + (offs - req[s].offs);
+
+                // spans are whole blocks, so whole inodes are there.
+                csum_verify(e, offs, p, e->sb.s_inode_size, false, csum_inode, order[j].inode_index, "inode");
+                memcpy(&inodes[order[j].pos], p, inode_size);
+            }
+    }
+
+    free(buf);
+    free(span_first);
+    free(req);
+
+dump:
+    if (log_enabled(EXT4FS_LOG_DUMP))
+        for (i = 0; i < count; i++)
+            dump_inode(e, inode_index[i], &inodes[i]);
+    free(order);
+}
+
+/* inode table scan.
+ *
+ * groups are visited in order. the inode bitmap tells used inodes, and with
+ * group checksums, inodes after (s_inodes_per_group - bg_itable_unused) were
+ * never used. the table is read by INODE_BATCH_SIZE windows, each from its
+ * first to last used inode with one request bypassing the block cache.
+ */
+#define SCAN_BATCH 256 // decoded inodes given to callback at once
+
+struct scan
+{
+    ext4fs_scan_cb_t cb;
+    // if set, called for each inode instead of 'cb'.
+    int (*each)(struct ext4fs *e, void *priv, uint32_t inode_index, const struct inode *inode);
+    void *priv;
+    uint8_t *buf;
+    uint32_t count;
+    struct ext4fs_inode batch[SCAN_BATCH];
+};
+
+static bool has_group_csum(struct ext4fs *e)
+{
+    return !!(e->sb.s_feature_ro_compat &
+              (EXT4_FEATURE_RO_COMPAT_GDT_CSUM | EXT4_FEATURE_RO_COMPAT_METADATA_CSUM));
+}
+
+static bool test_bit(const uint8_t *bitmap, uint32_t nr)
+{
+    return bitmap[nr / 8] & (1 << (nr % 8));
+}
+
+/* seconds since epoch and nanoseconds. the extra field, if i_extra_isize
+ * covers it, holds 2 epoch bits and nanoseconds.
+ */
+static struct timespec inode_time(const struct inode *inode, uint32_t sec, uint32_t extra,
+                                  size_t extra_offset)
+{
+    struct timespec ts = {.tv_sec = (int32_t)sec};
+
+    if (EXT4_GOOD_OLD_INODE_SIZE + inode->i_extra_isize >= extra_offset + sizeof(__le32))
+    {
+        ts.tv_sec += (int64_t)(extra & 3) << 32;
+        ts.tv_nsec = extra >> 2;
+    }
+    return ts;
+}
+
+static void decode_inode(struct ext4fs *e, uint32_t inode_index, const struct inode *inode,
+                         struct ext4fs_inode *out)
+{
+    out->inode = inode_index;
+    out->mode = inode->i_mode;
+    out->links = inode->i_links_count;
+    out->uid = ((uint32_t)inode->l_i_uid_high << 16) | inode->i_uid;
+    out->gid = ((uint32_t)inode->l_i_gid_high << 16) | inode->i_gid;
+    out->flags = inode->i_flags;
+    out->generation = inode->i_generation;
+    out->size = get64(inode->i_size);
+    out->blocks = ((uint64_t)inode->l_i_blocks_high << 32) | inode->i_blocks_lo;
+    out->atime = inode_time(inode, inode->i_atime, inode->i_atime_extra,
+                            offsetof(struct inode, i_atime_extra)).tv_sec;
+    out->mtime = inode_time(inode, inode->i_mtime, inode->i_mtime_extra,
+                            offsetof(struct inode, i_mtime_extra)).tv_sec;
+    out->ctime = inode_time(inode, inode->i_ctime, inode->i_ctime_extra,
+                            offsetof(struct inode, i_ctime_extra)).tv_sec;
+}
+
+static int scan_flush(struct scan *sc)
+{
+    int ret = 0;
+
+    if (sc->count)
+        ret = sc->cb(sc->priv, sc->batch, sc->count);
+    sc->count = 0;
+    return ret;
+}
+
+static int scan_group(struct ext4fs *e, struct scan *sc, uint32_t group)
+{
+    const struct bg_info *bg = get_bg(e, group);
+    uint32_t ipg = e->sb.s_inodes_per_group;
+    uint32_t inode_size = e->sb.s_inode_size;
+    uint32_t window = INODE_BATCH_SIZE / inode_size;
+    uint64_t table = bg->inode_table * e->block_size;
+    uint8_t bitmapbuf[e->block_size];
+    const uint8_t *bitmap;
+    uint32_t used = ipg;
+    uint32_t first;
+
+    if (bg->flags & EXT4_BG_INODE_UNINIT)
+        return 0;
+    if (has_group_csum(e) && bg->itable_unused <= ipg)
+        used = ipg - bg->itable_unused;
+    if (used == 0)
+        return 0;
+
+    bitmap = read_ptr(e, bg->inode_bitmap * e->block_size, bitmapbuf, (ipg + 7) / 8);
+
+    for (first = 0; first < used; first += window)
+    {
+        uint32_t lo = first, hi = first + window < used ? first + window : used;
+        uint64_t start, end;
+        const uint8_t *p = NULL;
+        uint32_t i;
+
+        while (lo < hi && !test_bit(bitmap, lo))
+            lo++;
+        while (hi > lo && !test_bit(bitmap, hi - 1))
+            hi--;
+        if (lo == hi)
+            continue;
+
+        start = (table + (uint64_t)lo * inode_size) & ~(uint64_t)(e->block_size - 1);
+        end = (table + (uint64_t)hi * inode_size + e->block_size - 1) & ~(uint64_t)(e->block_size - 1);
+        p = borrow(e, start, end - start);
+        if (!p)
+        {
+            do_read_uncached(e, start, sc->buf, end - start);
+            p = sc->buf;
+        }
+        debug("group %u inodes %u..%u, %llu bytes\n", group, lo, hi, (long long)(end - start));
+
+        for (i = lo; i < hi; i++)
+        {
+            uint32_t inode_index = group * ipg + i + 1;
+            uint64_t offs = table + (uint64_t)i * inode_size;
+            const void *raw = p + (offs - start);
+            struct inode inode = {};
+            int ret;
+
+            if (!test_bit(bitmap, i))
+                continue;
+
+            csum_verify(e, offs, raw, inode_size, false, csum_inode, inode_index, "inode");
+            memcpy(&inode, raw, inode_size < sizeof(inode) ? inode_size : sizeof(inode));
+            if (log_enabled(EXT4FS_LOG_DUMP))
+                dump_inode(e, inode_index, &inode);
+            // reserved inodes which are not set up.
+            if (inode.i_mode == 0)
+                continue;
+
+            if (sc->each)
+            {
+                if ((ret = sc->each(e, sc->priv, inode_index, &inode)) != 0)
+                    return ret;
+                continue;
+            }
+            decode_inode(e, inode_index, &inode, &sc->batch[sc->count++]);
+            if (sc->count == SCAN_BATCH && (ret = scan_flush(sc)) != 0)
+                return ret;
+        }
+    }
+
+    return scan_flush(sc);
+}
+
+struct extent_header
+{
+#define EH_MAGIC 0xF30A
+    __le16 eh_magic;
+    __le16 eh_entries;
+    __le16 eh_max;
+    __le16 eh_depth;
+    __le32 eh_generation;
+};
+
+struct extent_idx
+{
+    __le32 ei_block;
+    __le32 ei_leaf_lo;
+    __le16 ei_leaf_hi;
+    __le16 ei_unused;
+};
+
+/* ee_len above EXT_INIT_MAX_LEN is an unwritten extent of (ee_len -
+ * EXT_INIT_MAX_LEN) blocks. they are allocated but read as zero.
+ */
+struct extent
+{
+    __le32 ee_block;
+    __le16 ee_len;
+    __le16 ee_start_hi;
+    __le32 ee_start_lo;
+};
+
+#define EXT_INIT_MAX_LEN 32768 // longest ee_len of written extent
+
+static uint32_t ee_len(const struct extent *ee)
+{
+    return ee->ee_len > EXT_INIT_MAX_LEN ? ee->ee_len - EXT_INIT_MAX_LEN : ee->ee_len;
+}
+
+static bool ee_unwritten(const struct extent *ee)
+{
+    return ee->ee_len > EXT_INIT_MAX_LEN;
+}
+
+// after eh_max entries of a tree block.
+struct extent_tail
+{
+    __le32 et_checksum;
+};
+
+static bool csum_extent_block(struct ext4fs *e, const void *data, uint32_t size, uint32_t seed)
+{
+    const struct extent_header *eh = data;
+    const struct extent_tail *et;
+    uint32_t offset = sizeof(*eh) + eh->eh_max * sizeof(struct extent);
+
+    if (offset + sizeof(*et) > size)
+        return false;
+
+    et = data + offset;
+    return crc32c(seed, data, offset) == et->et_checksum;
+}
+
+static void dump_eh(struct ext4fs *e, const struct extent_header *eh)
+{
+#define print_eh(m) dump("(%01x) eh->%-28s= 0x%0*llx(%llu)\n",               \
+                         (int)(long)&((struct extent_header *)NULL)->m, #m,  \
+                         sizeof(eh->m) * 2,                                  \
+                         (long long)eh->m, (long long)eh->m)
+    print_eh(eh_magic);
+    print_eh(eh_entries);
+    print_eh(eh_max);
+    print_eh(eh_depth);
+    print_eh(eh_generation);
+#undef print_eh
+}
+
+static void dump_ei(struct ext4fs *e, const struct extent_idx *ei)
+{
+#define print_ei(m) dump("(%01x) ee->%-28s= 0x%0*llx(%llu)\n",            \
+                         (int)(long)&((struct extent_idx *)NULL)->m, #m,  \
+                         sizeof(ei->m) * 2,                               \
+                         (long long)ei->m, (long long)ei->m)
+    print_ei(ei_block);
+    print_ei(ei_leaf_lo);
+    print_ei(ei_leaf_hi);
+#undef print_ee
+}
+
+static void dump_ee(struct ext4fs *e, const struct extent *ee)
+{
+#define print_ee(m) dump("(%01x) ee->%-28s= 0x%0*llx(%llu)\n",        \
+                         (int)(long)&((struct extent *)NULL)->m, #m,  \
+                         sizeof(ee->m) * 2,                           \
+                         (long long)ee->m, (long long)ee->m)
+    print_ee(ee_block);
+    print_ee(ee_len);
+    print_ee(ee_start_hi);
+    print_ee(ee_start_lo);
+#undef print_ee
+}
+
+/* flattened extent tree.
+ *
+ * extents of an inode are kept in one array sorted by logical block, so a
+ * block is found with binary search. subtrees are loaded lazily. until then
+ * an index entry stands for the whole logical range of the subtree.
+ *
+ * block maps of non-extent inodes are flattened the same way. runs of
+ * consecutive block pointers become one entry, and not loaded indirect blocks
+ * are index entries.
+ */
+struct extmap_entry
+{
+#define EXTMAP_INDEX 0x1    // not loaded subtree. 'phys' is the block of the node.
+#define EXTMAP_INDIRECT 0x2 // with EXTMAP_INDEX, the node is an indirect block.
+#define EXTMAP_LEVEL_SHIFT 2 // levels of indirect blocks from the node, 1 to 3.
+    uint32_t block_index;
+    uint32_t len;
+    uint64_t phys : 48;
+    uint64_t flags : 16;
+};
+
+struct extmap
+{
+    uint32_t count;
+    uint32_t max;
+    struct extmap_entry *ent;
+    uint32_t csum_seed; // of the inode
+
+    // data kept in the inode. no entries then.
+    uint8_t *inline_data;
+    uint64_t inline_size;
+};
+
+static void extmap_add(struct ext4fs *e, struct extmap *m, uint32_t block_index, uint32_t len,
+                       uint64_t phys, uint32_t flags)
+{
+    struct extmap_entry *ent;
+
+    if (len == 0)
+        return;
+
+    // extents continuing the last one, logically and physically, are merged.
+    if (m->count && !(flags & EXTMAP_INDEX))
+    {
+        ent = &m->ent[m->count - 1];
+        if (ent->flags == flags &&
+            ent->block_index + (uint64_t)ent->len == block_index &&
+            ent->phys + ent->len == phys &&
+            (uint64_t)ent->len + len <= UINT32_MAX)
+        {
+            ent->len += len;
+            return;
+        }
+    }
+
+    if (m->count == m->max)
+    {
+        m->max = m->max ? m->max * 2 : 16;
+        m->ent = realloc(m->ent, m->max * sizeof(m->ent[0]));
+        if (!m->ent)
+            fatal("no mem for extent map. %u\n", m->max);
+    }
+
+    ent = &m->ent[m->count++];
+    ent->block_index = block_index;
+    ent->len = len;
+    ent->phys = phys;
+    ent->flags = flags;
+}
+
+/* appends entries of node 'eh' which covers [start, end) logical blocks.
+ * index entries cover until the next index entry.
+ */
+static void extmap_add_node(struct ext4fs *e, struct extmap *m, const struct extent_header *eh,
+                            uint32_t start, uint64_t end)
+{
+    int i;
+
+    if (log_enabled(EXT4FS_LOG_DUMP))
+        dump_eh(e, eh);
+    if (eh->eh_magic != EH_MAGIC)
+        fatal("wrong eh_magic. 0x%04x\n", eh->eh_magic);
+
+    if (eh->eh_depth == 0)
+    {
+        const struct extent *ee = (void *)&eh[1];
+
+        for (i = 0; i < eh->eh_entries; i++, ee++)
+        {
+            if (log_enabled(EXT4FS_LOG_DUMP))
+                dump_ee(e, ee);
+            if (ee->ee_block < start || ee->ee_block + (uint64_t)ee_len(ee) > end)
+                fatal("extent out of node. %u+%u not in %u..%llu\n",
+                      ee->ee_block, ee_len(ee), start, (long long)end);
+            // unwritten extents are left as holes. they read as zero.
+            if (!ee_unwritten(ee))
+                extmap_add(e, m, ee->ee_block, ee->ee_len, get64(ee->ee_start), 0);
+        }
+    }
+    else
+    {
+        const struct extent_idx *ei = (void *)&eh[1];
+
+        for (i = 0; i < eh->eh_entries; i++, ei++)
+        {
+            uint64_t next = i + 1 < eh->eh_entries ? ei[1].ei_block : end;
+
+            if (log_enabled(EXT4FS_LOG_DUMP))
+                dump_ei(e, ei);
+            if (ei->ei_block < start || next > end || next <= ei->ei_block)
+                fatal("index out of node. %u..%llu not in %u..%llu\n",
+                      ei->ei_block, (long long)next, start, (long long)end);
+            extmap_add(e, m, ei->ei_block, next - ei->ei_block, get64(ei->ei_leaf), EXTMAP_INDEX);
+        }
+    }
+}
+
+#define EXT4_NDIR_BLOCKS 12 // direct blocks in i_block. then 1, 2 and 3 level indirect.
+
+// logical blocks mapped by an indirect block of 'level'.
+static uint64_t ind_span(struct ext4fs *e, int level)
+{
+    uint64_t span = 1;
+
+    while (level--)
+        span *= e->block_size / 4;
+    return span;
+}
+
+/* appends 'count' block pointers, which map from 'block_index'. pointers to
+ * data blocks are 'level' 0. 0 is a hole.
+ */
+static void extmap_add_ind(struct ext4fs *e, struct extmap *m, const __le32 *ptr, uint32_t count,
+                           uint64_t block_index, int level)
+{
+    uint64_t span = ind_span(e, level);
+    uint32_t i;
+
+    for (i = 0; i < count && block_index < UINT32_MAX; i++, block_index += span)
+    {
+        uint64_t len = span;
+
+        if (ptr[i] == 0)
+            continue;
+        if (block_index + len > UINT32_MAX)
+            len = UINT32_MAX - block_index;
+
+        if (level == 0)
+            extmap_add(e, m, block_index, len, ptr[i], 0);
+        else
+            extmap_add(e, m, block_index, len, ptr[i],
+                       EXTMAP_INDEX | EXTMAP_INDIRECT | (level << EXTMAP_LEVEL_SHIFT));
+    }
+}
+
+static void extmap_init(struct ext4fs *e, struct extmap *m, uint32_t inode_index,
+                        const struct inode *inode)
+{
+    const __le32 *ptr = (const void *)&inode->i_block[0];
+    uint64_t block_index;
+    int level;
+
+    memset(m, 0, sizeof(*m));
+    m->csum_seed = inode_csum_seed(e, inode_index, inode->i_generation);
+
+    if (inode_is_inline(inode))
+    {
+        m->inline_data = read_inline(e, inode_index, inode, &m->inline_size);
+        return;
+    }
+
+    if (inode->i_flags & EXT4_EXTENTS_FL)
+    {
+        extmap_add_node(e, m, (void *)&inode->i_block[0], 0, UINT32_MAX);
+        return;
+    }
+
+    extmap_add_ind(e, m, ptr, EXT4_NDIR_BLOCKS, 0, 0);
+    block_index = EXT4_NDIR_BLOCKS;
+    for (level = 1; level <= 3; level++)
+    {
+        extmap_add_ind(e, m, ptr + EXT4_NDIR_BLOCKS + level - 1, 1, block_index, level);
+        block_index += ind_span(e, level);
+    }
+}
+
+static void extmap_free(struct extmap *m)
+{
+    free(m->ent);
+    free(m->inline_data);
+    memset(m, 0, sizeof(*m));
+}
+
+// returns the last entry starting at or before 'block_index', or -1.
+static int64_t extmap_find(const struct extmap *m, uint32_t block_index)
+{
+    int64_t lo = 0, hi = (int64_t)m->count - 1, found = -1;
+
+    while (lo <= hi)
+    {
+        int64_t mid = (lo + hi) / 2;
+
+        if (m->ent[mid].block_index <= block_index)
+        {
+            found = mid;
+            lo = mid + 1;
+        }
+        else
+            hi = mid - 1;
+    }
+
+    return found;
+}
+
+// returns the first entry which overlaps or follows 'block_index'.
+static uint32_t extmap_first(const struct extmap *m, uint32_t block_index)
+{
+    int64_t i = extmap_find(m, block_index);
+
+    if (i < 0)
+        return 0;
+    if (block_index >= m->ent[i].block_index + (uint64_t)m->ent[i].len)
+        return i + 1;
+    return i;
+}
+
+/* loads all subtrees overlapping [start, end) logical blocks.
+ *
+ * nodes of one level are fetched with one batch, then spliced into the array
+ * in place of their index entries. repeated until only extents remain.
+ */
+static void extmap_load(struct ext4fs *e, struct extmap *m, uint32_t start, uint64_t end)
+{
+    while (true)
+    {
+        struct extmap old = *m;
+        struct ext4fs_read_req *req;
+        const void **node;
+        void *nodebuf;
+        uint32_t first, last, i, n;
+
+        first = extmap_first(&old, start);
+        for (last = first, n = 0; last < old.count && old.ent[last].block_index < end; last++)
+            if (old.ent[last].flags & EXTMAP_INDEX)
+                n++;
+        if (n == 0)
+            return;
+
+        req = malloc(n * sizeof(req[0]));
+        node = malloc((last - first) * sizeof(node[0]));
+        nodebuf = malloc((uint64_t)n * e->block_size);
+        if (!req || !node || !nodebuf)
+            fatal("no mem for extent nodes. %u\n", n);
+
+        for (i = first, n = 0; i < last; i++)
+        {
+            const struct extmap_entry *ent = &old.ent[i];
+
+            node[i - first] = NULL;
+            if (!(ent->flags & EXTMAP_INDEX))
+                continue;
+
+            node[i - first] = borrow(e, ent->phys * e->block_size, e->block_size);
+            if (!node[i - first])
+            {
+                node[i - first] = nodebuf + (uint64_t)n * e->block_size;
+                req[n].offs = ent->phys * e->block_size;
+                req[n].data = (void *)node[i - first];
+                req[n].size = e->block_size;
+                n++;
+            }
+        }
+        do_readv(e, req, n);
+
+        memset(m, 0, sizeof(*m));
+        m->csum_seed = old.csum_seed;
+        m->max = old.count + 64;
+        m->ent = malloc(m->max * sizeof(m->ent[0]));
+        if (!m->ent)
+            fatal("no mem for extent map. %u\n", m->max);
+
+        memcpy(m->ent, old.ent, first * sizeof(m->ent[0]));
+        m->count = first;
+        for (i = first; i < last; i++)
+        {
+            const struct extmap_entry *ent = &old.ent[i];
+
+            if (!node[i - first])
+                extmap_add(e, m, ent->block_index, ent->len, ent->phys, ent->flags);
+            else if (ent->flags & EXTMAP_INDIRECT)
+                extmap_add_ind(e, m, node[i - first], e->block_size / 4, ent->block_index,
+                               (ent->flags >> EXTMAP_LEVEL_SHIFT) - 1);
+            else
+            {
+                csum_verify(e, ent->phys * e->block_size, node[i - first], e->block_size,
+                            !e->borrow_cb, csum_extent_block, old.csum_seed, "extent block");
+                extmap_add_node(e, m, node[i - first], ent->block_index,
+                                ent->block_index + (uint64_t)ent->len);
+            }
+        }
+        for (; i < old.count; i++)
+            extmap_add(e, m, old.ent[i].block_index, old.ent[i].len,
+                       old.ent[i].phys, old.ent[i].flags);
+
+        free(nodebuf);
+        free(node);
+        free(req);
+        free(old.ent);
+    }
+}
+
+/* finds the extent mapping 'block_index'.
+ *
+ * 'bm' is set to the logical and physical block range from 'block_index'. if
+ * 'block_index' is in a hole, physical block is 0 and the range spans until
+ * the next extent.
+ */
+struct block_map
+{
+    uint32_t block_index;
+    uint32_t len;
+    uint64_t phys; // 0 for hole
+};
+
+static void extmap_lookup(struct ext4fs *e, struct extmap *m, uint32_t block_index,
+                          struct block_map *bm)
+{
+    const struct extmap_entry *ent;
+    uint32_t i;
+
+    extmap_load(e, m, block_index, (uint64_t)block_index + 1);
+
+    bm->block_index = block_index;
+    i = extmap_first(m, block_index);
+    if (i == m->count)
+    {
+        bm->len = UINT32_MAX - block_index;
+        bm->phys = 0;
+        return;
+    }
+
+    ent = &m->ent[i];
+    if (ent->block_index > block_index)
+    {
+        bm->len = ent->block_index - block_index;
+        bm->phys = 0;
+        return;
+    }
+
+    bm->len = ent->block_index + ent->len - block_index;
+    bm->phys = ent->phys + (block_index - ent->block_index);
+}
+
+#define READ_REQ_MAX (1u << 30) // bytes of one read request
+
+// position in an iovec array.
+struct iov_cursor
+{
+    const struct iovec *iov;
+    int iovcnt;
+    int v;
+    size_t off;
+};
+
+/* returns the current buffer, and advances up to '*size' bytes within it.
+ * '*size' is trimmed to the bytes taken.
+ */
+static void *iov_take(struct ext4fs *e, struct iov_cursor *c, uint64_t *size)
+{
+    void *p;
+
+    while (c->v < c->iovcnt && c->off == c->iov[c->v].iov_len)
+    {
+        c->v++;
+        c->off = 0;
+    }
+    if (c->v == c->iovcnt)
+        fatal("read beyond buffers.\n");
+
+    if (*size > c->iov[c->v].iov_len - c->off)
+        *size = c->iov[c->v].iov_len - c->off;
+
+    p = (uint8_t *)c->iov[c->v].iov_base + c->off;
+    c->off += *size;
+
+    return p;
+}
+
+static void iov_zero(struct ext4fs *e, struct iov_cursor *c, uint64_t size)
+{
+    while (size)
+    {
+        uint64_t n = size;
+        void *p = iov_take(e, c, &n);
+
+        memset(p, 0, n);
+        size -= n;
+    }
+}
+
+/* reads [offs, offs + size) of inode data into buffers 'iov'. the range should
+ * be within i_size, and 'size' should be the total of buffers. holes are zero
+ * filled.
+ *
+ * an extent spanning several buffers gives adjacent requests, which readv_cb
+ * may read with one scatter/gather I/O.
+ */
+static void read_inode_rangev(struct ext4fs *e, const struct inode *inode, struct extmap *m,
+                              const struct iovec *iov, int iovcnt, uint64_t size, uint64_t offs)
+{
+    struct iov_cursor cur = {.iov = iov, .iovcnt = iovcnt};
+    struct ext4fs_read_req *req = NULL;
+    uint32_t req_count = 0, req_max = 0;
+    uint64_t start_block_index, end_block_index;
+    uint64_t pos = offs, end = offs + size;
+    uint32_t i;
+    bool cached;
+
+    if (m->inline_data)
+    {
+        while (pos < end)
+        {
+            uint64_t n = end - pos;
+            void *p = iov_take(e, &cur, &n);
+
+            memcpy(p, m->inline_data + pos, n);
+            pos += n;
+        }
+        return;
+    }
+
+    start_block_index = offs / e->block_size;
+    end_block_index = (end + e->block_size - 1) / e->block_size;
+    debug("start_block_index 0x%08llx, end_block_index 0x%08llx\n",
+          (long long)start_block_index, (long long)end_block_index);
+
+    extmap_load(e, m, start_block_index, end_block_index);
+
+    for (i = extmap_first(m, start_block_index); i < m->count && pos < end; i++)
+    {
+        const struct extmap_entry *ent = &m->ent[i];
+        uint64_t ent_start = (uint64_t)ent->block_index * e->block_size;
+        uint64_t ent_end = ent_start + (uint64_t)ent->len * e->block_size;
+
+        if (ent_start >= end)
+            break;
+
+        // hole before this extent.
+        if (ent_start > pos)
+        {
+            iov_zero(e, &cur, ent_start - pos);
+            pos = ent_start;
+        }
+
+        if (ent_end > end)
+            ent_end = end;
+        while (pos < ent_end)
+        {
+            uint64_t n = ent_end - pos;
+
+            if (n > READ_REQ_MAX)
+                n = READ_REQ_MAX;
+
+            if (req_count == req_max)
+            {
+                req_max = req_max ? req_max * 2 : 16;
+                req = realloc(req, req_max * sizeof(req[0]));
+                if (!req)
+                    fatal("no mem for read requests. %u\n", req_max);
+            }
+            req[req_count].data = iov_take(e, &cur, &n);
+            req[req_count].offs = ent->phys * e->block_size + (pos - ent_start);
+            req[req_count].size = n;
+            debug("read data size %llu from 0x%08llx\n",
+                  (long long)req[req_count].size, (long long)req[req_count].offs);
+            pos += n;
+            req_count++;
+        }
+    }
+
+    // hole at the end.
+    if (pos < end)
+        iov_zero(e, &cur, end - pos);
+
+    // file contents are not kept in block cache. only metadata.
+    cached = (inode->i_mode & 0xf000) != S_IFREG;
+    if (cached)
+        do_readv(e, req, req_count);
+    else
+        do_readv_uncached(e, req, req_count);
+
+    free(req);
+}
+
+static void read_inode_range(struct ext4fs *e, const struct inode *inode, struct extmap *m,
+                             void *data, uint64_t size, uint64_t offs)
+{
+    struct iovec iov = {.iov_base = data, .iov_len = size};
+
+    read_inode_rangev(e, inode, m, &iov, 1, size, offs);
+}
+
+static void *read_inode_data(struct ext4fs *e, uint32_t inode_index, const struct inode *inode,
+                             uint64_t *size)
+{
+    struct extmap m = {};
+    void *data;
+    uint64_t data_size;
+
+    if (inode_is_inline(inode))
+        return read_inline(e, inode_index, inode, size);
+
+    *size = data_size = get64(inode->i_size);
+    data = malloc(data_size);
+    if (!data)
+        fatal("no memory for data. %llu\n", (long long)data_size);
+
+    extmap_init(e, &m, inode_index, inode);
+    read_inode_range(e, inode, &m, data, data_size, 0);
+    extmap_free(&m);
+    debug("got data size 0x%08llx\n", data_size);
+
+    return data;
+}
+
+/* jbd2 journal.
+ *
+ * images of unclean filesystems have committed transactions not yet written
+ * to their places. like recovery at mount, the log is walked from s_start.
+ * descriptor blocks list the filesystem blocks whose copies follow them, and
+ * a commit block completes the transaction. revoke records cancel copies in
+ * the same or earlier transactions. nothing is written. the last committed
+ * copy of each block is read instead of the block, see journal_readv().
+ *
+ * fields are big endian. fast commits are not replayed.
+ */
+#define JBD2_MAGIC 0xC03B3998
+#define JBD2_DESCRIPTOR_BLOCK 1
+#define JBD2_COMMIT_BLOCK 2
+#define JBD2_SUPERBLOCK_V1 3
+#define JBD2_SUPERBLOCK_V2 4
+#define JBD2_REVOKE_BLOCK 5
+
+struct journal_header
+{
+    __be32 h_magic;
+    __be32 h_blocktype;
+    __be32 h_sequence;
+};
+
+struct journal_superblock
+{
+    struct journal_header s_header;
+    __be32 s_blocksize;
+    __be32 s_maxlen; // blocks in the journal
+    __be32 s_first;  // first block of log
+    __be32 s_sequence;
+    __be32 s_start;  // first block of the oldest transaction. 0 if clean.
+    __be32 s_errno;
+    __be32 s_feature_compat;
+#define JBD2_FEATURE_INCOMPAT_REVOKE 0x1
+#define JBD2_FEATURE_INCOMPAT_64BIT 0x2
+#define JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT 0x4
+#define JBD2_FEATURE_INCOMPAT_CSUM_V2 0x8
+#define JBD2_FEATURE_INCOMPAT_CSUM_V3 0x10
+#define JBD2_FEATURE_INCOMPAT_FAST_COMMIT 0x20
+    __be32 s_feature_incompat;
+    __be32 s_feature_ro_compat;
+    __u8 s_uuid[16];
+    __be32 s_nr_users;
+    __be32 s_dynsuper;
+    __be32 s_max_transaction;
+    __be32 s_max_trans_data;
+    __u8 s_checksum_type;
+    __u8 s_padding2[3];
+    __be32 s_num_fc_blks; // fast commit blocks at the end. 0 for default.
+};
+
+#define JBD2_DEFAULT_FAST_COMMIT_BLOCKS 256
+
+// tag size depends on features. see journal_tag_size().
+struct journal_block_tag
+{
+    __be32 t_blocknr;
+    __be16 t_checksum;
+    __be16 t_flags;
+    __be32 t_blocknr_high; // 64bit only
+};
+
+struct journal_block_tag3
+{
+    __be32 t_blocknr;
+#define JBD2_FLAG_ESCAPE 0x1    // first word of the copy was JBD2_MAGIC. it is zero.
+#define JBD2_FLAG_SAME_UUID 0x2 // no uuid after the tag
+#define JBD2_FLAG_LAST_TAG 0x8
+    __be32 t_flags;
+    __be32 t_blocknr_high;
+    __be32 t_checksum;
+};
+
+struct commit_header
+{
+    struct journal_header h;
+    __u8 h_chksum_type;
+    __u8 h_chksum_size;
+    __u8 h_padding[2];
+    __be32 h_chksum[8];
+};
+
+struct journal_revoke_header
+{
+    struct journal_header r_header;
+    __be32 r_count; // bytes used in the block, with this header
+};
+
+// copy of 'blk' at journal block 'pos', in transaction 'sequence'.
+struct journal_tag
+{
+    uint64_t blk;
+    uint32_t pos;
+    uint32_t sequence;
+    uint32_t index; // in log order
+    uint32_t csum;
+    bool escape;
+};
+
+struct journal_revoke
+{
+    uint64_t blk;
+    uint32_t sequence;
+};
+
+struct journal
+{
+    struct extmap map;
+    uint32_t incompat;
+    uint32_t first;
+    uint32_t last; // end of log
+    uint32_t csum_seed;
+    uint8_t *buf;
+
+    struct journal_tag *tag;
+    uint32_t tag_count;
+    uint32_t tag_max;
+    struct journal_revoke *revoke;
+    uint32_t revoke_count;
+    uint32_t revoke_max;
+};
+
+static uint64_t journal_bmap(struct ext4fs *e, struct journal *j, uint32_t pos)
+{
+    struct block_map bm = {};
+
+    extmap_lookup(e, &j->map, pos, &bm);
+    if (!bm.phys)
+        fatal("hole in journal at block %u\n", pos);
+
+    return bm.phys;
+}
+
+static void journal_read(struct ext4fs *e, struct journal *j, uint32_t pos)
+{
+    do_read_uncached(e, journal_bmap(e, j, pos) * e->block_size, j->buf, e->block_size);
+}
+
+static uint32_t journal_next(struct journal *j, uint32_t pos)
+{
+    return pos + 1 < j->last ? pos + 1 : j->first;
+}
+
+static uint32_t journal_tag_size(struct journal *j)
+{
+    uint32_t size = sizeof(struct journal_block_tag);
+
+    if (j->incompat & JBD2_FEATURE_INCOMPAT_CSUM_V3)
+        return sizeof(struct journal_block_tag3);
+    if (j->incompat & JBD2_FEATURE_INCOMPAT_CSUM_V2)
+        size += sizeof(uint16_t);
+    if (!(j->incompat & JBD2_FEATURE_INCOMPAT_64BIT))
+        size -= sizeof(uint32_t);
+
+    return size;
+}
+
+static bool journal_has_csum(struct journal *j)
+{
+    return j->incompat & (JBD2_FEATURE_INCOMPAT_CSUM_V2 | JBD2_FEATURE_INCOMPAT_CSUM_V3);
+}
+
+// tags of a descriptor block at 'pos'. returns journal block after the copies.
+static uint32_t journal_descriptor(struct ext4fs *e, struct journal *j, uint32_t pos, uint32_t sequence)
+{
+    uint32_t tag_size = journal_tag_size(j);
+    uint32_t end = e->block_size - (journal_has_csum(j) ? sizeof(uint32_t) : 0);
+    uint32_t offs = sizeof(struct journal_header);
+
+    while (offs + tag_size <= end)
+    {
+        const struct journal_block_tag3 *t3 = (const void *)(j->buf + offs);
+        const struct journal_block_tag *t = (const void *)(j->buf + offs);
+        struct journal_tag *tag;
+        uint32_t flags;
+
+        if (j->tag_count == j->tag_max)
+        {
+            j->tag_max = j->tag_max ? j->tag_max * 2 : 256;
+            j->tag = realloc(j->tag, j->tag_max * sizeof(j->tag[0]));
+            if (!j->tag)
+                fatal("no mem for journal tags. %u\n", j->tag_max);
+        }
+        tag = &j->tag[j->tag_count++];
+
+        pos = journal_next(j, pos);
+        tag->blk = be32toh(t->t_blocknr);
+        if (j->incompat & JBD2_FEATURE_INCOMPAT_64BIT)
+            tag->blk |= (uint64_t)be32toh(t->t_blocknr_high) << 32;
+        if (j->incompat & JBD2_FEATURE_INCOMPAT_CSUM_V3)
+        {
+            flags = be32toh(t3->t_flags);
+            tag->csum = be32toh(t3->t_checksum);
+        }
+        else
+        {
+            flags = be16toh(t->t_flags);
+            tag->csum = be16toh(t->t_checksum);
+        }
+        tag->escape = flags & JBD2_FLAG_ESCAPE;
+        tag->index = j->tag_count - 1;
+        tag->pos = pos;
+        tag->sequence = sequence;
+        debug("journal transaction %u block %llu at %u\n", sequence, (long long)tag->blk, pos);
+
+        offs += tag_size;
+        if (!(flags & JBD2_FLAG_SAME_UUID))
+            offs += 16;
+        if (flags & JBD2_FLAG_LAST_TAG)
+            break;
+    }
+
+    return journal_next(j, pos);
+}
+
+static void journal_revoke_block(struct ext4fs *e, struct journal *j, uint32_t sequence)
+{
+    const struct journal_revoke_header *r = (const void *)j->buf;
+    uint32_t record_size = j->incompat & JBD2_FEATURE_INCOMPAT_64BIT ? 8 : 4;
+    uint32_t count = be32toh(r->r_count);
+    uint32_t offs;
+
+    if (count > e->block_size)
+        fatal("wrong journal revoke size %u\n", count);
+
+    for (offs = sizeof(*r); offs + record_size <= count; offs += record_size)
+    {
+        struct journal_revoke *rv;
+
+        if (j->revoke_count == j->revoke_max)
+        {
+            j->revoke_max = j->revoke_max ? j->revoke_max * 2 : 256;
+            j->revoke = realloc(j->revoke, j->revoke_max * sizeof(j->revoke[0]));
+            if (!j->revoke)
+                fatal("no mem for journal revokes. %u\n", j->revoke_max);
+        }
+        rv = &j->revoke[j->revoke_count++];
+        if (record_size == 8)
+            rv->blk = be64toh(*(const uint64_t *)(j->buf + offs));
+        else
+            rv->blk = be32toh(*(const __be32 *)(j->buf + offs));
+        rv->sequence = sequence;
+    }
+}
+
+// torn commit block of a crash ends the log.
+static bool journal_commit_ok(struct ext4fs *e, struct journal *j)
+{
+    struct commit_header *h = (void *)j->buf;
+    __be32 provided = h->h_chksum[0];
+    uint32_t csum;
+
+    if (!journal_has_csum(j))
+        return true;
+
+    h->h_chksum[0] = 0;
+    csum = crc32c(j->csum_seed, j->buf, e->block_size);
+    h->h_chksum[0] = provided;
+
+    return be32toh(provided) == csum;
+}
+
+// copy of the block, as in the journal, against the tag. csum_v2 keeps 16 bits.
+static bool journal_tag_ok(struct ext4fs *e, struct journal *j, const struct journal_tag *tag)
+{
+    __be32 sequence = htobe32(tag->sequence);
+    uint32_t csum;
+
+    journal_read(e, j, tag->pos);
+    csum = crc32c(j->csum_seed, &sequence, sizeof(sequence));
+    csum = crc32c(csum, j->buf, e->block_size);
+    if (!(j->incompat & JBD2_FEATURE_INCOMPAT_CSUM_V3))
+        csum &= 0xffff;
+
+    return csum == tag->csum;
+}
+
+static int cmp_journal_revoke(const void *a, const void *b)
+{
+    const struct journal_revoke *x = a;
+    const struct journal_revoke *y = b;
+
+    return x->blk < y->blk ? -1 : x->blk > y->blk;
+}
+
+/* whether the same or a later transaction revoked the block of 'tag'. sorted
+ * by block only. sequence numbers wrap, so the largest is not the latest and
+ * all revokes of the block are compared.
+ */
+static bool journal_revoked(struct journal *j, const struct journal_tag *tag)
+{
+    struct journal_revoke key = {.blk = tag->blk};
+    uint32_t lo = 0, hi = j->revoke_count;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (cmp_journal_revoke(&j->revoke[mid], &key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; lo < j->revoke_count && j->revoke[lo].blk == tag->blk; lo++)
+    {
+        if ((int32_t)(j->revoke[lo].sequence - tag->sequence) >= 0)
+            return true;
+    }
+
+    return false;
+}
+
+static int cmp_journal_tag(const void *a, const void *b)
+{
+    const struct journal_tag *x = a;
+    const struct journal_tag *y = b;
+
+    if (x->blk != y->blk)
+        return x->blk < y->blk ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/* remap table from committed tags. the last copy of a block wins. if it is
+ * revoked, earlier ones are too. with verify, copies failing their checksum
+ * are skipped, as recovery does.
+ */
+static void journal_build(struct ext4fs *e, struct journal *j)
+{
+    uint64_t blocks_count = get64(e->sb.s_blocks_count);
+    bool verify = e->verify && journal_has_csum(j);
+    uint32_t i, k, end;
+
+    // arrays are NULL without revokes or tags.
+    if (j->revoke_count)
+        qsort(j->revoke, j->revoke_count, sizeof(j->revoke[0]), cmp_journal_revoke);
+    if (j->tag_count)
+        qsort(j->tag, j->tag_count, sizeof(j->tag[0]), cmp_journal_tag);
+
+    e->journal = calloc(j->tag_count, sizeof(e->journal[0]));
+    if (j->tag_count && !e->journal)
+        fatal("no mem for journal blocks. %u\n", j->tag_count);
+
+    for (i = 0; i < j->tag_count; i = end)
+    {
+        const struct journal_tag *tag = NULL;
+        struct journal_block *jb;
+
+        for (end = i + 1; end < j->tag_count && j->tag[end].blk == j->tag[i].blk;)
+            end++;
+        if (j->tag[i].blk >= blocks_count)
+            continue;
+
+        for (k = end; k > i && !journal_revoked(j, &j->tag[k - 1]); k--)
+        {
+            if (!verify || journal_tag_ok(e, j, &j->tag[k - 1]))
+            {
+                tag = &j->tag[k - 1];
+                break;
+            }
+            debug("wrong checksum of journal block %u. block %llu skipped.\n",
+                  j->tag[k - 1].pos, (long long)j->tag[k - 1].blk);
+        }
+        if (!tag)
+            continue;
+
+        jb = &e->journal[e->journal_count++];
+        jb->blk = tag->blk;
+        jb->phys = journal_bmap(e, j, tag->pos);
+        if (tag->escape)
+        {
+            jb->data = malloc(e->block_size);
+            if (!jb->data)
+                fatal("no mem for journal block.\n");
+            journal_read(e, j, tag->pos);
+            memcpy(jb->data, j->buf, e->block_size);
+            *(__be32 *)jb->data = htobe32(JBD2_MAGIC);
+        }
+    }
+}
+
+/* builds the remap table from the journal, if the filesystem needs recovery.
+ * returns true if blocks were replayed.
+ */
+static bool journal_load(struct ext4fs *e)
+{
+    struct journal j = {};
+    const struct journal_superblock *jsb;
+    struct inode inodebuf;
+    const struct inode *inode;
+    uint32_t pos, sequence, walked;
+    uint32_t committed_tags = 0, committed_revokes = 0;
+
+    if (!e->journal_replay || !(e->sb.s_feature_compat & EXT4_FEATURE_COMPAT_HAS_JOURNAL) ||
+        !(e->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_RECOVER))
+        return false;
+    if (e->sb.s_journal_inum == 0)
+    {
+        debug("external journal. not replayed.\n");
+        return false;
+    }
+
+    inode = read_inode(e, e->sb.s_journal_inum, &inodebuf);
+    extmap_init(e, &j.map, e->sb.s_journal_inum, inode);
+    j.buf = malloc(e->block_size);
+    if (!j.buf)
+        fatal("no mem for journal block.\n");
+
+    journal_read(e, &j, 0);
+    jsb = (const void *)j.buf;
+    if (be32toh(jsb->s_header.h_magic) != JBD2_MAGIC)
+        fatal("wrong journal magic. 0x%08x\n", be32toh(jsb->s_header.h_magic));
+    if (be32toh(jsb->s_blocksize) != e->block_size)
+        fatal("wrong journal block size. %u\n", be32toh(jsb->s_blocksize));
+
+    if (be32toh(jsb->s_header.h_blocktype) == JBD2_SUPERBLOCK_V2)
+        j.incompat = be32toh(jsb->s_feature_incompat);
+    j.first = be32toh(jsb->s_first);
+    j.last = be32toh(jsb->s_maxlen);
+    if (j.incompat & JBD2_FEATURE_INCOMPAT_FAST_COMMIT)
+        j.last -= jsb->s_num_fc_blks ? be32toh(jsb->s_num_fc_blks) : JBD2_DEFAULT_FAST_COMMIT_BLOCKS;
+    if (journal_has_csum(&j))
+    {
+        pthread_once(&crc32c_once, crc32c_init);
+        j.csum_seed = crc32c(~0u, jsb->s_uuid, sizeof(jsb->s_uuid));
+    }
+    pos = be32toh(jsb->s_start);
+    sequence = be32toh(jsb->s_sequence);
+    debug("journal features 0x%x, log %u..%u, start %u, sequence %u\n",
+          j.incompat, j.first, j.last, pos, sequence);
+    if (pos == 0 || j.first == 0 || j.first >= j.last || pos < j.first || pos >= j.last)
+    {
+        extmap_free(&j.map);
+        free(j.buf);
+        return false;
+    }
+
+    // log blocks are visited once at most, as sequence numbers go up.
+    for (walked = 0; walked < j.last - j.first;)
+    {
+        const struct journal_header *h = (const void *)j.buf;
+        uint32_t type;
+
+        journal_read(e, &j, pos);
+        if (be32toh(h->h_magic) != JBD2_MAGIC || be32toh(h->h_sequence) != sequence)
+            break;
+
+        type = be32toh(h->h_blocktype);
+        if (type == JBD2_DESCRIPTOR_BLOCK)
+        {
+            uint32_t tag_count = j.tag_count;
+
+            pos = journal_descriptor(e, &j, pos, sequence);
+            walked += 1 + j.tag_count - tag_count;
+        }
+        else if (type == JBD2_REVOKE_BLOCK)
+        {
+            journal_revoke_block(e, &j, sequence);
+            pos = journal_next(&j, pos);
+            walked++;
+        }
+        else if (type == JBD2_COMMIT_BLOCK && journal_commit_ok(e, &j))
+        {
+            committed_tags = j.tag_count;
+            committed_revokes = j.revoke_count;
+            e->journal_transactions++;
+            sequence++;
+            pos = journal_next(&j, pos);
+            walked++;
+        }
+        else
+            break;
+    }
+
+    // the transaction after the last commit was not completed.
+    j.tag_count = committed_tags;
+    j.revoke_count = committed_revokes;
+    journal_build(e, &j);
+    debug("journal replayed %llu transactions, %u blocks\n",
+          (long long)e->journal_transactions, e->journal_count);
+
+    extmap_free(&j.map);
+    free(j.buf);
+    free(j.tag);
+    free(j.revoke);
+
+    return e->journal_count > 0;
+}
+
+struct dir_entry
+{
+    __le32 inode;
+    __le16 rec_len;
+    __u8 name_len;
+    __u8 file_type;
+    char name[0];
+};
+
+/* hashed directory index (htree).
+ *
+ * block 0 of an indexed directory is dx_root. "." and ".." entries are
+ * followed by dx_root_info and the sorted (hash, block) entries. interior
+ * nodes hide their entries behind an empty dir_entry spanning the block.
+ * entries[0].hash holds count and limit instead of a hash.
+ */
+struct dx_root_info
+{
+    __le32 reserved_zero;
+#define DX_HASH_LEGACY 0
+#define DX_HASH_HALF_MD4 1
+#define DX_HASH_TEA 2
+#define DX_HASH_LEGACY_UNSIGNED 3
+#define DX_HASH_HALF_MD4_UNSIGNED 4
+#define DX_HASH_TEA_UNSIGNED 5
+    __u8 hash_version;
+    __u8 info_length;
+    __u8 indirect_levels;
+    __u8 unused_flags;
+};
+
+struct dx_countlimit
+{
+    __le16 limit;
+    __le16 count;
+};
+
+struct dx_entry
+{
+    __le32 hash;
+    __le32 block;
+};
+
+#define DX_ROOT_INFO_OFFSET 24 // after "." and ".." entries
+#define DX_NODE_ENTRIES_OFFSET 8 // after empty dir_entry
+#define DX_MAX_LEVELS 3
+
+// fake dir_entry at the end of leaf blocks, holding the checksum.
+struct dir_entry_tail
+{
+    __le32 det_reserved_zero1;
+    __le16 det_rec_len; // 12
+    __u8 det_reserved_zero2;
+#define DIR_TAIL_FT 0xDE
+    __u8 det_reserved_ft;
+    __le32 det_checksum;
+};
+
+// after 'limit' entries of dx_root and interior nodes.
+struct dx_tail
+{
+    __le32 dt_reserved;
+    __le32 dt_checksum;
+};
+
+static bool csum_dx_block(struct ext4fs *e, const void *data, uint32_t size, uint32_t seed)
+{
+    const struct dir_entry *de = data;
+    const struct dx_countlimit *cl;
+    const struct dx_tail *t;
+    uint32_t count_offset;
+    uint32_t csum, zero = 0;
+
+    if (de->rec_len == size)
+        count_offset = DX_NODE_ENTRIES_OFFSET;
+    else if (de->rec_len == 12)
+    {
+        const struct dir_entry *dotdot = data + 12;
+        const struct dx_root_info *info = data + DX_ROOT_INFO_OFFSET;
+
+        if (dotdot->rec_len != size - 12 || info->reserved_zero || info->info_length != sizeof(*info))
+            return false;
+        count_offset = DX_ROOT_INFO_OFFSET + sizeof(*info);
+    }
+    else
+        return false;
+
+    cl = data + count_offset;
+    if (cl->count > cl->limit ||
+        count_offset + cl->limit * sizeof(struct dx_entry) + sizeof(*t) > size)
+        return false;
+
+    t = data + count_offset + cl->limit * sizeof(struct dx_entry);
+    csum = crc32c(seed, data, count_offset + cl->count * sizeof(struct dx_entry));
+    csum = crc32c(csum, t, offsetof(struct dx_tail, dt_checksum));
+    csum = crc32c(csum, &zero, sizeof(zero));
+
+    return csum == t->dt_checksum;
+}
+
+// leaf blocks end with dir_entry_tail. dx_root and interior nodes with dx_tail.
+static bool csum_dir_block(struct ext4fs *e, const void *data, uint32_t size, uint32_t seed)
+{
+    const struct dir_entry_tail *t = data + size - sizeof(*t);
+
+    if (t->det_reserved_zero1 == 0 && t->det_rec_len == sizeof(*t) &&
+        t->det_reserved_zero2 == 0 && t->det_reserved_ft == DIR_TAIL_FT)
+        return crc32c(seed, data, size - sizeof(*t)) == t->det_checksum;
+
+    return csum_dx_block(e, data, size, seed);
+}
+
+/* each_ee() returns
+ *  0    : continue for next extent.
+ *  != 0 : stop for futher loop.
+ */
+typedef int (*each_ee_t)(struct ext4fs *e, void *priv, const struct extent *ee);
+
+static int foreach_extent_eh(struct ext4fs *e, const struct extent_header *eh, uint32_t csum_seed,
+                             each_ee_t each_ee, void *priv)
+{
+    int i;
+
+    if (log_enabled(EXT4FS_LOG_DUMP))
+        dump_eh(e, eh);
+    if (eh->eh_magic != EH_MAGIC)
+        fatal("wrong eh_magic. 0x%04x\n", eh->eh_magic);
+
+    if (eh->eh_depth == 0)
+    {
+        const struct extent *ee = (void *)&eh[1];
+
+        for (i = 0; i < eh->eh_entries; i++, ee++)
+        {
+            if (log_enabled(EXT4FS_LOG_DUMP))
+                dump_ee(e, ee);
+            if (each_ee(e, priv, ee) != 0)
+                return 1;
+        }
+    }
+    else
+    {
+        const struct extent_idx *ei = (void *)&eh[1];
+        uint32_t leafbuf[e->block_size / 4];
+
+        for (i = 0; i < eh->eh_entries; i++, ei++)
+        {
+            const struct extent_header *leaf_eh;
+
+            if (log_enabled(EXT4FS_LOG_DUMP))
+                dump_ei(e, ei);
+            leaf_eh = read_checked(e, get64(ei->ei_leaf) * e->block_size, leafbuf, e->block_size,
+                                   csum_extent_block, csum_seed, "extent block");
+            if (foreach_extent_eh(e, leaf_eh, csum_seed, each_ee, priv) != 0)
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+// block maps are flattened, then given as extents.
+static void foreach_extent_ind(struct ext4fs *e, uint32_t inode_index, const struct inode *inode,
+                               each_ee_t each_ee, void *priv)
+{
+    struct extmap m;
+    uint32_t i;
+
+    extmap_init(e, &m, inode_index, inode);
+    extmap_load(e, &m, 0, UINT32_MAX);
+
+    for (i = 0; i < m.count; i++)
+    {
+        uint32_t done;
+
+        for (done = 0; done < m.ent[i].len;)
+        {
+            struct extent ee = {};
+            uint32_t len = m.ent[i].len - done;
+
+            if (len > EXT_INIT_MAX_LEN)
+                len = EXT_INIT_MAX_LEN;
+            ee.ee_block = m.ent[i].block_index + done;
+            ee.ee_len = len;
+            ee.ee_start_lo = m.ent[i].phys + done;
+            ee.ee_start_hi = (m.ent[i].phys + done) >> 32;
+            if (each_ee(e, priv, &ee) != 0)
+                goto out;
+            done += len;
+        }
+    }
+
+out:
+    extmap_free(&m);
+}
+
+// calls each_ee() for all leaf extents of inode in logical order.
+static void foreach_extent(struct ext4fs *e, uint32_t inode_index, const struct inode *inode,
+                           each_ee_t each_ee, void *priv)
+{
+    if (!(inode->i_flags & EXT4_EXTENTS_FL))
+    {
+        foreach_extent_ind(e, inode_index, inode, each_ee, priv);
+        return;
+    }
+
+    foreach_extent_eh(e, (void *)&inode->i_block[0],
+                      inode_csum_seed(e, inode_index, inode->i_generation), each_ee, priv);
+}
+
+/* each_de() returns
+ *  0    : continue for next dir_entry.
+ *  != 0 : stop for futher loop.
+ *
+ * each_de() should ignore directory entries which is (de->inode == 0)
+ */
+typedef int (*each_de_t)(struct ext4fs *e, void *priv, const struct dir_entry *de);
+
+struct foreach_dir_priv
+{
+    uint64_t size;
+    uint32_t csum_seed;
+    each_de_t each_de;
+    void *priv;
+};
+
+// walks directory entries of 'size' bytes at 'dir_offset' of directory.
+static int foreach_dir_entries(struct ext4fs *e, struct foreach_dir_priv *dir, const void *block,
+                               uint32_t size, uint64_t dir_offset)
+{
+    uint32_t i;
+
+    for (i = 0; i < size;)
+    {
+        const struct dir_entry *de = block + i;
+
+        if (de->inode && log_enabled(EXT4FS_LOG_DUMP))
+        {
+            dump("de offset %lld\n", (long long)(dir_offset + i));
+            dump("de->inode     0x%08x\n", de->inode);
+            dump("de->rec_len   0x%04x\n", de->rec_len);
+            dump("de->name_len  0x%02x\n", de->name_len);
+            dump("de->file_type 0x%02x\n", de->file_type);
+            dump("de->name      \"%.*s\"\n", de->name_len, de->name);
+        }
+
+        if (de->rec_len < 8 || i + de->rec_len > size)
+            fatal("wrong rec_len %u at 0x%llx\n", de->rec_len, (long long)(dir_offset + i));
+
+        if (dir->each_de && dir->each_de(e, dir->priv, de) != 0)
+            return 1;
+
+        i += de->rec_len;
+    }
+
+    return 0;
+}
+
+// walks directory entries in the blocks of one extent, in place.
+static int foreach_dir_each_ee(struct ext4fs *e, void *priv, const struct extent *ee)
+{
+    struct foreach_dir_priv *dir = priv;
+    uint32_t blockbuf[e->block_size / 4];
+    uint32_t b;
+
+    if (ee_unwritten(ee))
+        return 0;
+
+    for (b = 0; b < ee->ee_len; b++)
+    {
+        uint64_t dir_offset = (uint64_t)(ee->ee_block + b) * e->block_size;
+        const void *block;
+
+        if (dir_offset >= dir->size)
+            return 1;
+
+        block = read_checked(e, (get64(ee->ee_start) + b) * e->block_size, blockbuf, e->block_size,
+                             csum_dir_block, dir->csum_seed, "directory block");
+
+        if (foreach_dir_entries(e, dir, block, e->block_size, dir_offset) != 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+#define EXT4_FT_DIR 2
+
+/* inline directory starts with the inode number of parent, instead of "."
+ * and ".." entries. they are made up here, so callers see the same entries
+ * as in directory blocks. entries go on in system.data xattr.
+ */
+static void foreach_dir_inline(struct ext4fs *e, uint32_t inode_index, const struct inode *inode,
+                               struct foreach_dir_priv *dir)
+{
+    uint32_t dots[6] = {};
+    struct dir_entry *de;
+    uint8_t *data;
+    uint64_t size;
+
+    data = read_inline(e, inode_index, inode, &size);
+    if (size < EXT4_MIN_INLINE_DATA_SIZE)
+        fatal("wrong inline directory size %llu\n", (long long)size);
+
+    de = (void *)&dots[0];
+    de->inode = inode_index;
+    de->rec_len = 12;
+    de->name_len = 1;
+    de->file_type = EXT4_FT_DIR;
+    memcpy(de->name, ".", 1);
+    de = (void *)&dots[3];
+    de->inode = *(__le32 *)data;
+    de->rec_len = 12;
+    de->name_len = 2;
+    de->file_type = EXT4_FT_DIR;
+    memcpy(de->name, "..", 2);
+
+    if (foreach_dir_entries(e, dir, dots, sizeof(dots), 0) == 0 &&
+        foreach_dir_entries(e, dir, data + 4, EXT4_MIN_INLINE_DATA_SIZE - 4, 4) == 0)
+        foreach_dir_entries(e, dir, data + EXT4_MIN_INLINE_DATA_SIZE, size - EXT4_MIN_INLINE_DATA_SIZE,
+                            EXT4_MIN_INLINE_DATA_SIZE);
+    free(data);
+}
+
+static void foreach_dir(struct ext4fs *e, uint32_t inode_index, const struct inode *inode,
+                        each_de_t each_de, void *priv)
+{
+    struct foreach_dir_priv dir = {};
+
+    if (!(inode->i_mode & S_IFDIR))
+        fatal("not directory\n");
+
+    // if (inode->i_flags & EXT4_INDEX_FL)
+    //     fatal("hashed directory index. not implemented.\n");
+
+    dir.size = get64(inode->i_size);
+    dir.csum_seed = inode_csum_seed(e, inode_index, inode->i_generation);
+    dir.each_de = each_de;
+    dir.priv = priv;
+    if (inode->i_flags & EXT4_INLINE_DATA_FL)
+        foreach_dir_inline(e, inode_index, inode, &dir);
+    else
+        foreach_extent(e, inode_index, inode, foreach_dir_each_ee, &dir);
+}
+
+struct search_inode_priv
+{
+    char *searching;
+    uint32_t inode_index;
+};
+
+static int search_inode_index_each_de(struct ext4fs *e, void *priv, const struct dir_entry *de)
+{
+    struct search_inode_priv *search = priv;
+
+    if (de->inode == 0)
+        return 0;
+
+    debug("searching \"%s\", this \"%.*s\"\n", search->searching,
+          de->name_len, de->name);
+    if (!strncmp(search->searching, de->name, de->name_len) &&
+        search->searching[de->name_len] == 0)
+    {
+        search->inode_index = de->inode;
+        debug("same. inode_index %d\n", de->inode);
+        return 1;
+    }
+
+    return 0;
+}
+
+static uint32_t dx_hack_hash(const char *name, int len, bool unsigned_char)
+{
+    uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        int c = unsigned_char ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+
+        hash = hash1 + (hash0 ^ (c * 7152373));
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+
+    return hash0 << 1;
+}
+
+static void str2hashbuf(const char *msg, int len, uint32_t *buf, int num, bool unsigned_char)
+{
+    uint32_t pad, val;
+    int i;
+
+    pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+
+    val = pad;
+    if (len > num * 4)
+        len = num * 4;
+    for (i = 0; i < len; i++)
+    {
+        int c = unsigned_char ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+
+        val = c + (val << 8);
+        if ((i % 4) == 3)
+        {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0)
+        *buf++ = val;
+    while (--num >= 0)
+        *buf++ = pad;
+}
+
+static void tea_transform(uint32_t buf[4], const uint32_t in[4])
+{
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+    int n = 16;
+
+    do
+    {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    } while (--n);
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+#define rol32(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD4_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = rol32(a, s))
+#define MD4_K1 0
+#define MD4_K2 013240474631UL
+#define MD4_K3 015666365641UL
+
+static void half_md4_transform(uint32_t buf[4], const uint32_t in[8])
+{
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    MD4_ROUND(MD4_F, a, b, c, d, in[0] + MD4_K1, 3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[1] + MD4_K1, 7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[2] + MD4_K1, 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[3] + MD4_K1, 19);
+    MD4_ROUND(MD4_F, a, b, c, d, in[4] + MD4_K1, 3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[5] + MD4_K1, 7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[6] + MD4_K1, 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[7] + MD4_K1, 19);
+
+    MD4_ROUND(MD4_G, a, b, c, d, in[1] + MD4_K2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[3] + MD4_K2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[5] + MD4_K2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[7] + MD4_K2, 13);
+    MD4_ROUND(MD4_G, a, b, c, d, in[0] + MD4_K2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[2] + MD4_K2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[4] + MD4_K2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[6] + MD4_K2, 13);
+
+    MD4_ROUND(MD4_H, a, b, c, d, in[3] + MD4_K3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[7] + MD4_K3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[2] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[6] + MD4_K3, 15);
+    MD4_ROUND(MD4_H, a, b, c, d, in[1] + MD4_K3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[5] + MD4_K3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[0] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[4] + MD4_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+// same as ext4fs_dirhash() of linux. only the major hash is needed for lookup.
+static uint32_t dx_hash(struct ext4fs *e, int hash_version, const char *name, int len)
+{
+    uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    uint32_t in[8];
+    uint32_t hash;
+    bool unsigned_char = false;
+    int i;
+
+    for (i = 0; i < 4; i++)
+        if (e->sb.s_hash_seed[i])
+        {
+            memcpy(buf, e->sb.s_hash_seed, sizeof(buf));
+            break;
+        }
+
+    switch (hash_version)
+    {
+    case DX_HASH_LEGACY_UNSIGNED:
+        unsigned_char = true;
+        // fall through
+    case DX_HASH_LEGACY:
+        hash = dx_hack_hash(name, len, unsigned_char);
+        break;
+    case DX_HASH_HALF_MD4_UNSIGNED:
+        unsigned_char = true;
+        // fall through
+    case DX_HASH_HALF_MD4:
+        for (i = 0; i < len; i += 32)
+        {
+            str2hashbuf(name + i, len - i, in, 8, unsigned_char);
+            half_md4_transform(buf, in);
+        }
+        hash = buf[1];
+        break;
+    case DX_HASH_TEA_UNSIGNED:
+        unsigned_char = true;
+        // fall through
+    case DX_HASH_TEA:
+        for (i = 0; i < len; i += 16)
+        {
+            str2hashbuf(name + i, len - i, in, 4, unsigned_char);
+            tea_transform(buf, in);
+        }
+        hash = buf[0];
+        break;
+    default:
+        fatal("unknown hash version. %d\n", hash_version);
+        return 0;
+    }
+
+    hash &= ~1;
+    if (hash == (0x7fffffffu << 1))
+        hash = (0x7fffffffu - 1) << 1;
+
+    return hash;
+}
+
+// reads logical block 'block_index' of directory.
+static const void *read_dir_block(struct ext4fs *e, struct extmap *m, uint32_t block_index, void *buf)
+{
+    struct block_map bm;
+
+    extmap_lookup(e, m, block_index, &bm);
+    if (bm.phys == 0)
+        fatal("hole in directory. block %u\n", block_index);
+
+    return read_checked(e, bm.phys * e->block_size, buf, e->block_size,
+                        csum_dir_block, m->csum_seed, "directory block");
+}
+
+// returns inode index of 'name' in one directory block, or 0.
+static uint32_t search_dir_block(struct ext4fs *e, const void *block, const char *name, int len)
+{
+    uint32_t i;
+
+    for (i = 0; i < e->block_size;)
+    {
+        const struct dir_entry *de = block + i;
+
+        if (de->rec_len < 8 || i + de->rec_len > e->block_size)
+            fatal("wrong rec_len %u at 0x%x\n", de->rec_len, i);
+
+        if (de->inode && de->name_len == len && !memcmp(de->name, name, len))
+            return de->inode;
+
+        i += de->rec_len;
+    }
+
+    return 0;
+}
+
+/* looks 'name' up in hashed directory. reads dx_root, one block per index
+ * level and the leaf block(s) which can hold the hash.
+ *
+ * returns false if the index cannot be used. '*inode_index' is 0 if the name
+ * does not exist.
+ */
+static bool search_dx_dir(struct ext4fs *e, uint32_t dir_index, const struct inode *inode,
+                          const char *name, uint32_t *inode_index)
+{
+    uint8_t buf[DX_MAX_LEVELS][e->block_size] __attribute__((aligned(8)));
+    uint8_t leafbuf[e->block_size] __attribute__((aligned(8)));
+    const struct dx_entry *entries[DX_MAX_LEVELS];
+    uint32_t count[DX_MAX_LEVELS];
+    uint32_t at[DX_MAX_LEVELS];
+    const struct dx_root_info *info;
+    struct extmap m;
+    int len = strlen(name);
+    int hash_version;
+    int levels, level;
+    uint32_t hash, block_index;
+    const void *root;
+
+    if (!(e->sb.s_feature_compat & EXT4_FEATURE_COMPAT_DIR_INDEX) ||
+        !(inode->i_flags & EXT4_INDEX_FL))
+        return false;
+
+    // "." and ".." are in dx_root, not in hashed leaves.
+    if (!strcmp(name, ".") || !strcmp(name, ".."))
+        return false;
+
+    extmap_init(e, &m, dir_index, inode);
+
+    root = read_dir_block(e, &m, 0, buf[0]);
+    info = root + DX_ROOT_INFO_OFFSET;
+    hash_version = info->hash_version;
+    if (hash_version <= DX_HASH_TEA && (e->sb.s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+        hash_version += DX_HASH_LEGACY_UNSIGNED;
+    levels = info->indirect_levels + 1;
+
+    if (info->reserved_zero != 0 || info->info_length != 8 ||
+        levels > DX_MAX_LEVELS || hash_version > DX_HASH_TEA_UNSIGNED)
+    {
+        debug("unsupported dx_root. hash_version %d, info_length %d, indirect_levels %d\n",
+              info->hash_version, info->info_length, info->indirect_levels);
+        extmap_free(&m);
+        return false;
+    }
+
+    hash = dx_hash(e, hash_version, name, len);
+    debug("dx hash of \"%s\" 0x%08x, version %d, levels %d\n", name, hash, hash_version, levels);
+
+    entries[0] = (void *)info + info->info_length;
+    for (level = 0; level < levels; level++)
+    {
+        const struct dx_countlimit *cl = (void *)entries[level];
+        uint32_t lo, hi;
+
+        count[level] = cl->count;
+        if (count[level] == 0 || count[level] > cl->limit)
+            fatal("wrong dx count %u, limit %u\n", cl->count, cl->limit);
+
+        // last entry with hash <= target. entries[0] covers from hash 0.
+        lo = 1;
+        hi = count[level];
+        while (lo < hi)
+        {
+            uint32_t mid = (lo + hi) / 2;
+
+            if (entries[level][mid].hash > hash)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        at[level] = lo - 1;
+        block_index = entries[level][at[level]].block;
+        debug("dx level %d, entry %u/%u, block %u\n", level, at[level], count[level], block_index);
+
+        if (level + 1 < levels)
+            entries[level + 1] = read_dir_block(e, &m, block_index, buf[level + 1]) +
+                                 DX_NODE_ENTRIES_OFFSET;
+    }
+
+    while (true)
+    {
+        const void *leaf = read_dir_block(e, &m, block_index, leafbuf);
+
+        *inode_index = search_dir_block(e, leaf, name, len);
+        if (*inode_index)
+            break;
+
+        /* names with the same hash may continue in the next leaf. then the
+         * next entry's hash has the lowest bit set.
+         */
+        for (level = levels - 1; level >= 0; level--)
+            if (at[level] + 1 < count[level])
+                break;
+        if (level < 0)
+            break;
+
+        at[level]++;
+        if ((entries[level][at[level]].hash & ~1) != hash)
+            break;
+
+        block_index = entries[level][at[level]].block;
+        for (level++; level < levels; level++)
+        {
+            entries[level] = read_dir_block(e, &m, block_index, buf[level]) +
+                             DX_NODE_ENTRIES_OFFSET;
+            count[level] = ((const struct dx_countlimit *)entries[level])->count;
+            at[level] = 0;
+            block_index = entries[level][0].block;
+        }
+    }
+
+    extmap_free(&m);
+    return true;
+}
+
+// returns inode index of 'filename', or 0 if it does not exist.
+static uint32_t lookup_path(struct ext4fs *e, const char *filename)
+{
+    char *str = strdup(filename);
+    char *tok, *save = NULL;
+    uint32_t inode_index = 2; // start from root inode index
+
+    if (!str)
+        fatal("no mem for path.\n");
+
+    tok = strtok_r(str, "/", &save);
+    while (tok)
+    {
+        struct search_inode_priv search = {};
+        struct inode inodebuf = {};
+        const struct inode *inode;
+        uint32_t parent = inode_index;
+
+        debug("tok \"%s\"\n", tok);
+        if (dcache_lookup(e, parent, tok, &inode_index))
+        {
+            debug("dcache. inode_index %d\n", inode_index);
+            if (inode_index == 0)
+                break;
+
+            tok = strtok_r(NULL, "/", &save);
+            continue;
+        }
+
+        search.searching = tok;
+        inode = read_inode(e, inode_index, &inodebuf);
+        if ((inode->i_mode & 0xf000) != S_IFDIR)
+        {
+            inode_index = 0;
+            break;
+        }
+
+        if (search_dx_dir(e, inode_index, inode, tok, &search.inode_index))
+            debug("dx search. inode_index %d\n", search.inode_index);
+        else
+            foreach_dir(e, inode_index, inode, search_inode_index_each_de, &search);
+
+        inode_index = search.inode_index;
+        dcache_insert(e, parent, tok, inode_index);
+        if (inode_index == 0)
+            break;
+
+        tok = strtok_r(NULL, "/", &save);
+    }
+
+    free(str);
+    debug("inode index %d\n", inode_index);
+    return inode_index;
+}
+
+static uint32_t search_inode_index(struct ext4fs *e, const char *filename)
+{
+    uint32_t inode_index;
+
+    inode_index = lookup_path(e, filename);
+    if (inode_index == 0)
+        fatal("cannot search \"%s\".\n", filename);
+
+    return inode_index;
+}
+
+static void printf_inode(struct ext4fs *e, const struct inode *inode, uint32_t inode_index,
+                         const char *name, uint32_t name_len)
+{
+    char ftype;
+
+    switch (inode->i_mode & 0xf000)
+    {
+    case S_IFIFO:
+        ftype = 'f';
+        break;
+    case S_IFCHR:
+        ftype = 'c';
+        break;
+    case S_IFDIR:
+        ftype = 'd';
+        break;
+    case S_IFBLK:
+        ftype = 'b';
+        break;
+    case S_IFREG:
+        ftype = '-';
+        break;
+    case S_IFLNK:
+        ftype = 'l';
+        break;
+    case S_IFSOCK:
+        ftype = 's';
+        break;
+    default:
+        ftype = '?';
+        break;
+    }
+
+    printf("%7d %c%c%c%c%c%c%c%c%c%c %4d.%-4d %8llu %-.*s",
+           inode_index, ftype,
+           inode->i_mode & S_IRUSR ? 'r' : '-',
+           inode->i_mode & S_IWUSR ? 'w' : '-',
+           inode->i_mode & S_IXUSR ? 'x' : '-',
+           inode->i_mode & S_IRGRP ? 'r' : '-',
+           inode->i_mode & S_IWGRP ? 'w' : '-',
+           inode->i_mode & S_IXGRP ? 'x' : '-',
+           inode->i_mode & S_IROTH ? 'r' : '-',
+           inode->i_mode & S_IWOTH ? 'w' : '-',
+           inode->i_mode & S_IXOTH ? 'x' : '-',
+           inode->i_uid, inode->i_gid,
+           (long long)get64(inode->i_size),
+           name_len, name);
+
+    if ((inode->i_mode & 0xf000) == S_IFLNK)
+    {
+        void *data;
+        uint64_t data_size;
+
+        data = read_inode_data(e, inode_index, inode, &data_size);
+        printf(" -> %.*s", (unsigned int)data_size, (char *)data);
+        free(data);
+    }
+    printf("\n");
+}
+
+struct ext4fs_file
+{
+    struct ext4fs *e;
+
+    uint32_t inode_index;
+    struct inode inode;
+
+    struct extmap extmap;
+};
+
+static struct ext4fs_file *open_inode(struct ext4fs *e, uint32_t inode_index)
+{
+    struct ext4fs_file *f;
+    const struct inode *inode;
+
+    f = calloc(1, sizeof(*f));
+    if (!f)
+        fatal("no mem for file.\n");
+
+    f->e = e;
+    f->inode_index = inode_index;
+    inode = read_inode(e, inode_index, &f->inode);
+    if (inode != &f->inode)
+        f->inode = *inode;
+
+    // devices, fifos and sockets have no data.
+    switch (inode->i_mode & 0xf000)
+    {
+    case S_IFLNK:
+    case S_IFREG:
+    case S_IFDIR:
+        extmap_init(e, &f->extmap, inode_index, inode);
+        break;
+    }
+
+    return f;
+}
+
+/* directory cursor. one directory block is read at a time, so memory stays
+ * the same for any directory size. positions are offsets in the directory,
+ * except inline directories, whose made up "." and ".." come first.
+ */
+struct ext4fs_dir
+{
+    struct ext4fs_file *f;
+    uint32_t csum_seed;
+    uint64_t size;
+    uint64_t pos;        // of next entry
+    uint64_t block_offs; // of 'block'. UINT64_MAX if not loaded.
+    bool synced;         // 'pos' is on an entry of 'block'
+    uint32_t block_size;
+    const uint8_t *block;
+    uint8_t *blockbuf;   // inline directory, or block read without borrow
+    struct ext4fs_dirent ent;
+};
+
+// returns NULL if not directory.
+static struct ext4fs_dir *open_dir(struct ext4fs *e, uint32_t inode_index)
+{
+    struct ext4fs_dir *d;
+    struct ext4fs_file *f;
+
+    f = open_inode(e, inode_index);
+    if ((f->inode.i_mode & 0xf000) != S_IFDIR)
+    {
+        ext4fs_close(f);
+        return NULL;
+    }
+
+    d = calloc(1, sizeof(*d));
+    if (!d)
+        fatal("no mem for directory.\n");
+    d->f = f;
+    d->csum_seed = inode_csum_seed(e, inode_index, f->inode.i_generation);
+    d->block_offs = UINT64_MAX;
+
+    if (f->extmap.inline_data)
+    {
+        uint64_t inline_size = f->extmap.inline_size;
+        struct dir_entry *de;
+
+        if (inline_size < EXT4_MIN_INLINE_DATA_SIZE)
+            fatal("wrong inline directory size %llu\n", (long long)inline_size);
+
+        // "." and "..", then entries after the parent inode number.
+        d->size = d->block_size = 24 + inline_size - 4;
+        d->blockbuf = calloc(1, d->size);
+        if (!d->blockbuf)
+            fatal("no mem for inline directory.\n");
+        de = (void *)d->blockbuf;
+        de->inode = inode_index;
+        de->rec_len = 12;
+        de->name_len = 1;
+        de->file_type = EXT4_FT_DIR;
+        memcpy(de->name, ".", 1);
+        de = (void *)(d->blockbuf + 12);
+        de->inode = *(__le32 *)f->extmap.inline_data;
+        de->rec_len = 12;
+        de->name_len = 2;
+        de->file_type = EXT4_FT_DIR;
+        memcpy(de->name, "..", 2);
+        memcpy(d->blockbuf + 24, f->extmap.inline_data + 4, inline_size - 4);
+        d->block = d->blockbuf;
+        d->block_offs = 0;
+    }
+    else
+    {
+        d->size = get64(f->inode.i_size);
+        d->block_size = e->block_size;
+        d->blockbuf = malloc(e->block_size);
+        if (!d->blockbuf)
+            fatal("no mem for directory block.\n");
+    }
+
+    return d;
+}
+
+/* loads the block holding 'pos', and moves 'pos' to the first entry at or
+ * after it. holes are skipped.
+ */
+static void load_dir_block(struct ext4fs *e, struct ext4fs_dir *d)
+{
+    uint64_t block_offs = d->pos - d->pos % d->block_size;
+    uint32_t i;
+
+    if (block_offs != d->block_offs)
+    {
+        struct block_map bm = {};
+
+        d->block_offs = UINT64_MAX;
+        extmap_lookup(e, &d->f->extmap, block_offs / e->block_size, &bm);
+        if (!bm.phys)
+        {
+            d->pos = block_offs + d->block_size;
+            return;
+        }
+        d->block = read_checked(e, bm.phys * e->block_size, d->blockbuf, e->block_size,
+                                csum_dir_block, d->csum_seed, "directory block");
+        d->block_offs = block_offs;
+    }
+
+    // positions from ext4fs_telldir() are on entries. others are moved.
+    for (i = 0; i < d->pos - block_offs;)
+    {
+        const struct dir_entry *de = (const void *)(d->block + i);
+
+        if (de->rec_len < 8 || i + de->rec_len > d->block_size)
+            fatal("wrong rec_len %u at 0x%llx\n", de->rec_len, (long long)(block_offs + i));
+        i += de->rec_len;
+    }
+    d->pos = block_offs + i;
+    d->synced = true;
+}
+
+// returns NULL at end of directory.
+static const struct ext4fs_dirent *read_dir(struct ext4fs *e, struct ext4fs_dir *d)
+{
+    while (d->pos < d->size)
+    {
+        const struct dir_entry *de;
+        uint32_t offset_in_block;
+
+        if (!d->synced || d->pos - d->pos % d->block_size != d->block_offs)
+        {
+            load_dir_block(e, d);
+            continue;
+        }
+
+        offset_in_block = d->pos - d->block_offs;
+        de = (const void *)(d->block + offset_in_block);
+        if (de->rec_len < 8 || offset_in_block + de->rec_len > d->block_size ||
+            8 + de->name_len > de->rec_len)
+            fatal("wrong rec_len %u at 0x%llx\n", de->rec_len, (long long)d->pos);
+
+        if (de->inode && log_enabled(EXT4FS_LOG_DUMP))
+        {
+            dump("de offset %lld\n", (long long)d->pos);
+            dump("de->inode     0x%08x\n", de->inode);
+            dump("de->rec_len   0x%04x\n", de->rec_len);
+            dump("de->name_len  0x%02x\n", de->name_len);
+            dump("de->file_type 0x%02x\n", de->file_type);
+            dump("de->name      \"%.*s\"\n", de->name_len, de->name);
+        }
+        d->pos += de->rec_len;
+        if (de->inode == 0)
+            continue;
+
+        d->ent.inode = de->inode;
+        d->ent.file_type = de->file_type;
+        d->ent.name_len = de->name_len;
+        memcpy(d->ent.name, de->name, de->name_len);
+        d->ent.name[de->name_len] = 0;
+
+        return &d->ent;
+    }
+
+    return NULL;
+}
+
+static void close_dir(struct ext4fs_dir *d)
+{
+    ext4fs_close(d->f);
+    free(d->blockbuf);
+    free(d);
+}
+
+struct list_priv
+{
+    uint32_t count;
+    uint32_t max;
+    uint32_t *inode_index;
+    char **name;
+};
+
+// collects entries. inodes are read afterwards with one batch.
+static int list_each_de(struct ext4fs *e, void *priv, const struct dir_entry *de)
+{
+    struct list_priv *list = priv;
+
+    if (de->inode == 0)
+        return 0;
+
+    if (list->count == list->max)
+    {
+        list->max = list->max ? list->max * 2 : 64;
+        list->inode_index = realloc(list->inode_index, list->max * sizeof(list->inode_index[0]));
+        list->name = realloc(list->name, list->max * sizeof(list->name[0]));
+        if (!list->inode_index || !list->name)
+            fatal("no mem for directory entries. %u\n", list->max);
+    }
+
+    list->inode_index[list->count] = de->inode;
+    list->name[list->count] = strndup(de->name, de->name_len);
+    if (!list->name[list->count])
+        fatal("no mem for name.\n");
+    list->count++;
+
+    return 0;
+}
+
+/* entries are printed as they are read, with inodes read in batches. so the
+ * first come out before a large directory is read through. smaller batches
+ * make more inode table requests.
+ */
+#define LIST_BATCH 1024
+
+struct list_batch
+{
+    struct ext4fs_dirent ent[LIST_BATCH];
+    uint32_t inode_index[LIST_BATCH];
+    struct inode inodes[LIST_BATCH];
+};
+
+static int cmd_list(struct ext4fs *e, char **argv)
+{
+    char *file = argv[0];
+    uint32_t inode_index;
+    struct inode inodebuf = {};
+    const struct inode *inode;
+
+    if (!file)
+        file = "/";
+
+    inode_index = search_inode_index(e, file);
+    debug("inode index %d\n", inode_index);
+
+    inode = read_inode(e, inode_index, &inodebuf);
+    if ((inode->i_mode & 0xf000) == S_IFDIR)
+    {
+        struct list_batch *batch;
+        struct ext4fs_dir *d;
+        const struct ext4fs_dirent *de;
+        uint32_t count = 0, total = 0, i;
+
+        printf("listing directory. \"%s\"...\n", file);
+        batch = malloc(sizeof(*batch));
+        d = open_dir(e, inode_index);
+        if (!batch || !d)
+            fatal("no mem for listing.\n");
+
+        do
+        {
+            de = read_dir(e, d);
+            if (de)
+                batch->ent[count++] = *de;
+            if (count && (count == LIST_BATCH || !de))
+            {
+                for (i = 0; i < count; i++)
+                    batch->inode_index[i] = batch->ent[i].inode;
+                memset(batch->inodes, 0, count * sizeof(batch->inodes[0]));
+                read_inodes(e, count, batch->inode_index, batch->inodes);
+                for (i = 0; i < count; i++)
+                    printf_inode(e, &batch->inodes[i], batch->inode_index[i], batch->ent[i].name,
+                                 batch->ent[i].name_len);
+                total += count;
+                count = 0;
+            }
+        } while (de);
+        printf("all %u files.\n", total);
+
+        close_dir(d);
+        free(batch);
+    }
+    else
+        printf_inode(e, inode, inode_index, file, strlen(file));
+
+    return 0;
+}
+
+/* readdir <dir> [<n>]. prints inode and name of entries read with the
+ * directory cursor API. with <n>, the cursor is closed after every <n> entries
+ * and another resumes at ext4fs_telldir(). one more is set a byte before that,
+ * inside the last entry read, and should resume at the same entry.
+ */
+static int cmd_readdir(struct ext4fs *e, char **argv)
+{
+    char *path = argv[0];
+    uint32_t every = path && argv[1] ? strtoul(argv[1], NULL, 0) : 0;
+    struct ext4fs_dirent want = {}; // inode 0 for end
+    const struct ext4fs_dirent *ent;
+    struct ext4fs_dir *d;
+    uint32_t count = 0;
+    bool check = false;
+
+    if (!path)
+        fatal("no directory\n");
+
+    d = ext4fs_opendir(e, path);
+    if (!d)
+        fatal("cannot open directory \"%s\".\n", path);
+
+    while (true)
+    {
+        ent = ext4fs_readdir(d);
+        if (check && (ent ? ent->inode != want.inode || strcmp(ent->name, want.name) : want.inode != 0))
+            fatal("cursor set inside an entry resumes at \"%s\", not \"%s\".\n",
+                  want.inode ? want.name : "end", ent ? ent->name : "end");
+        check = false;
+        if (!ent)
+            break;
+
+        printf("%u %s\n", ent->inode, ent->name);
+        if (every && ++count % every == 0)
+        {
+            uint64_t pos = ext4fs_telldir(d);
+            struct ext4fs_dir *mid = ext4fs_opendir(e, path);
+            const struct ext4fs_dirent *next;
+
+            ext4fs_seekdir(mid, pos - 1);
+            next = ext4fs_readdir(mid);
+            memset(&want, 0, sizeof(want));
+            if (next)
+                want = *next;
+            check = true;
+            ext4fs_closedir(mid);
+
+            ext4fs_closedir(d);
+            d = ext4fs_opendir(e, path);
+            ext4fs_seekdir(d, pos);
+        }
+    }
+    ext4fs_closedir(d);
+
+    return 0;
+}
+
+static void write_all(struct ext4fs *e, int fd, const void *data, uint64_t size)
+{
+    while (size)
+    {
+        ssize_t r;
+
+        r = write(fd, data, size);
+        if (r < 0)
+            fatal("write() failed.\n");
+
+        data += r;
+        size -= r;
+    }
+}
+
+#define CAT_BUFFER_SIZE (1024 * 1024)
+
+/* copies [offs, end) of file data to 'fd'. mapped ranges are copied by
+ * copy_cb if it is set. holes, or ranges it could not copy, go through 'buf'
+ * of CAT_BUFFER_SIZE bytes. returns end of copied data, which is before 'end'
+ * at end of file.
+ */
+static uint64_t copy_range(struct ext4fs *e, struct ext4fs_file *f, int fd, void *buf,
+                           uint64_t offs, uint64_t end)
+{
+    while (offs < end)
+    {
+        struct ext4fs_map map = {};
+        uint64_t map_end;
+
+        // let the image copy mapped ranges to output by itself.
+        if (e->copy_cb)
+        {
+            if (!ext4fs_map(f, offs, &map))
+                break;
+
+            map_end = map.size < end - offs ? offs + map.size : end;
+            if (!(map.flags & (EXT4FS_MAP_HOLE | EXT4FS_MAP_INLINE | EXT4FS_MAP_JOURNAL)) &&
+                e->copy_cb(e->priv, map.phys, map_end - offs, fd) == 0)
+            {
+                offs = map_end;
+                continue;
+            }
+        }
+        else
+            map_end = end;
+
+        while (offs < map_end)
+        {
+            uint64_t got;
+            uint64_t size = CAT_BUFFER_SIZE;
+
+            if (size > map_end - offs)
+                size = map_end - offs;
+
+            got = ext4fs_pread(f, buf, size, offs);
+            if (got == 0)
+                break;
+
+            write_all(e, fd, buf, got);
+            offs += got;
+        }
+        if (offs < map_end)
+            break;
+    }
+
+    return offs;
+}
+
+/* copies file data to 'fd'. if 'sparse', holes and unwritten extents are
+ * skipped with lseek(), so they take no time, and no space in output. 'fd'
+ * should be a file then. returns bytes copied, including holes.
+ */
+static uint64_t copy_file(struct ext4fs *e, struct ext4fs_file *f, int fd, void *buf, bool sparse)
+{
+    uint64_t size = get64(f->inode.i_size);
+    uint64_t offs = 0;
+    int64_t data;
+
+    if (!sparse)
+        return copy_range(e, f, fd, buf, 0, UINT64_MAX);
+
+    while ((data = ext4fs_seek_data(f, offs)) >= 0)
+    {
+        uint64_t hole = ext4fs_seek_hole(f, data);
+
+        if ((uint64_t)data > offs && lseek(fd, data - offs, SEEK_CUR) < 0)
+            fatal("lseek() failed. output should be a file for sparse copy.\n");
+        offs = copy_range(e, f, fd, buf, data, hole);
+        if (offs < hole)
+            return offs;
+    }
+
+    // hole at the end. output size is set by truncate.
+    if (offs < size)
+    {
+        off_t pos = lseek(fd, size - offs, SEEK_CUR);
+
+        if (pos < 0 || ftruncate(fd, pos) < 0)
+            fatal("cannot extend sparse output to %llu.\n", (long long)size);
+    }
+
+    return size;
+}
+
+/* reads the file with ext4fs_preadv() into buffers of odd sizes and counts,
+ * which split blocks and extents anywhere.
+ */
+static void cat_preadv(struct ext4fs *e, struct ext4fs_file *f, int fd, uint8_t *buf)
+{
+    static const uint32_t sizes[] = {1, 7, 509, 1024, 4099, 65536, 3, 200003};
+    const int max = sizeof(sizes) / sizeof(sizes[0]);
+    struct iovec iov[sizeof(sizes) / sizeof(sizes[0])];
+    uint64_t offs = 0, got;
+    uint32_t n;
+
+    for (n = 0;; n++)
+    {
+        uint8_t *p = buf;
+        int i;
+
+        for (i = 0; i < max; i++)
+        {
+            iov[i].iov_base = p;
+            iov[i].iov_len = sizes[(n + i) % max];
+            p += iov[i].iov_len;
+        }
+
+        got = ext4fs_preadv(f, iov, 1 + n % max, offs);
+        if (got == 0)
+            break;
+        write_all(e, fd, buf, got);
+        offs += got;
+    }
+}
+
+/* cat [-s | -v] <file>. with -s, holes of output are skipped as in the file.
+ * with -v, the file is read by ext4fs_preadv() into split buffers.
+ */
+static int cmd_cat(struct ext4fs *e, char **argv)
+{
+    bool sparse = argv[0] && !strcmp(argv[0], "-s");
+    bool vector = argv[0] && !strcmp(argv[0], "-v");
+    char *file = argv[sparse || vector ? 1 : 0];
+    struct ext4fs_file *f;
+    void *data;
+
+    if (!file)
+        fatal("no file\n");
+
+    f = ext4fs_open(e, file);
+    if (!f)
+        fatal("cannot search \"%s\".\n", file);
+
+    data = malloc(CAT_BUFFER_SIZE);
+    if (!data)
+        fatal("no mem for cat buffer.\n");
+
+    if (vector)
+        cat_preadv(e, f, 1, data);
+    else
+        copy_file(e, f, 1, data, sparse);
+
+    free(data);
+    ext4fs_close(f);
+
+    return 0;
+}
+
+/* parallel tree walk.
+ *
+ * a pool of workers visits the tree. each worker has its own deque of tasks;
+ * it pushes and pops at the tail, and idle workers steal from the head of
+ * others.
+ */
+#define WALK_MAX_THREADS 64
+
+struct walk_task
+{
+    uint32_t inode_index;
+    char *path;
+    struct inode *inode; // already read, or NULL
+};
+
+struct walk_deque
+{
+    pthread_mutex_t lock;
+    struct walk_task *task;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t max;
+};
+
+struct walk
+{
+    struct ext4fs *e;
+    uint32_t nthreads;
+    struct walk_deque deque[WALK_MAX_THREADS];
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t pending; // tasks queued or running
+    uint64_t queued;  // tasks in deques
+
+    // called by worker 'id' for each task. it may push more tasks.
+    void (*visit)(struct walk *wk, uint32_t id, const struct walk_task *t);
+};
+
+struct walk_worker
+{
+    struct walk *wk;
+    uint32_t id;
+    pthread_t thread;
+};
+
+// 'path' and 'inode' are freed after the visit.
+static void walk_push(struct walk *wk, uint32_t id, uint32_t inode_index, char *path, struct inode *inode)
+{
+    struct ext4fs *e = wk->e;
+    struct walk_deque *d = &wk->deque[id];
+
+    pthread_mutex_lock(&wk->lock);
+    wk->pending++;
+    pthread_mutex_unlock(&wk->lock);
+
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->max)
+    {
+        if (d->head)
+        {
+            memmove(d->task, d->task + d->head, (d->tail - d->head) * sizeof(d->task[0]));
+            d->tail -= d->head;
+            d->head = 0;
+        }
+        if (d->tail == d->max)
+        {
+            d->max = d->max ? d->max * 2 : 64;
+            d->task = realloc(d->task, d->max * sizeof(d->task[0]));
+            if (!d->task)
+                fatal("no mem for walk tasks. %u\n", d->max);
+        }
+    }
+    d->task[d->tail].inode_index = inode_index;
+    d->task[d->tail].path = path;
+    d->task[d->tail].inode = inode;
+    d->tail++;
+    pthread_mutex_unlock(&d->lock);
+
+    pthread_mutex_lock(&wk->lock);
+    wk->queued++;
+    pthread_cond_signal(&wk->cond);
+    pthread_mutex_unlock(&wk->lock);
+}
+
+// pops own tail, or steals the head of another worker.
+static bool walk_take(struct walk *wk, uint32_t id, struct walk_task *t)
+{
+    uint32_t i;
+
+    for (i = 0; i < wk->nthreads; i++)
+    {
+        struct walk_deque *d = &wk->deque[(id + i) % wk->nthreads];
+        bool got = false;
+
+        pthread_mutex_lock(&d->lock);
+        if (d->head < d->tail)
+        {
+            if (i == 0)
+                *t = d->task[--d->tail];
+            else
+                *t = d->task[d->head++];
+            if (d->head == d->tail)
+                d->head = d->tail = 0;
+            got = true;
+        }
+        pthread_mutex_unlock(&d->lock);
+
+        if (got)
+        {
+            pthread_mutex_lock(&wk->lock);
+            wk->queued--;
+            pthread_mutex_unlock(&wk->lock);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void *walk_worker(void *arg)
+{
+    struct walk_worker *w = arg;
+    struct walk *wk = w->wk;
+
+    while (true)
+    {
+        struct walk_task t;
+        bool done;
+
+        if (walk_take(wk, w->id, &t))
+        {
+            wk->visit(wk, w->id, &t);
+            free(t.path);
+            free(t.inode);
+
+            pthread_mutex_lock(&wk->lock);
+            if (--wk->pending == 0)
+                pthread_cond_broadcast(&wk->cond);
+            pthread_mutex_unlock(&wk->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&wk->lock);
+        while (wk->pending && !wk->queued)
+            pthread_cond_wait(&wk->cond, &wk->lock);
+        done = !wk->pending;
+        pthread_mutex_unlock(&wk->lock);
+        if (done)
+            break;
+    }
+
+    return NULL;
+}
+
+// 'arg' of thread count, or the number of cpus.
+static uint32_t walk_threads(const char *arg)
+{
+    long n = arg ? strtol(arg, NULL, 0) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1)
+        n = 1;
+    if (n > WALK_MAX_THREADS)
+        n = WALK_MAX_THREADS;
+    return n;
+}
+
+// visits tree from 'inode_index' at 'path' with wk->nthreads workers.
+static void walk_run(struct walk *wk, uint32_t inode_index, char *path)
+{
+    struct ext4fs *e = wk->e;
+    struct walk_worker w[WALK_MAX_THREADS] = {};
+    uint32_t i;
+
+    pthread_mutex_init(&wk->lock, NULL);
+    pthread_cond_init(&wk->cond, NULL);
+    for (i = 0; i < wk->nthreads; i++)
+        pthread_mutex_init(&wk->deque[i].lock, NULL);
+
+    walk_push(wk, 0, inode_index, path, NULL);
+
+    for (i = 0; i < wk->nthreads; i++)
+    {
+        w[i].wk = wk;
+        w[i].id = i;
+        if (pthread_create(&w[i].thread, NULL, walk_worker, &w[i]))
+            fatal("cannot create thread.\n");
+    }
+    for (i = 0; i < wk->nthreads; i++)
+        pthread_join(w[i].thread, NULL);
+    for (i = 0; i < wk->nthreads; i++)
+    {
+        free(wk->deque[i].task);
+        pthread_mutex_destroy(&wk->deque[i].lock);
+    }
+
+    pthread_cond_destroy(&wk->cond);
+    pthread_mutex_destroy(&wk->lock);
+}
+
+/* extract.
+ *
+ * the tree is copied by a walk. directories get their attributes after all
+ * workers are done, as creating entries in them changes mtime.
+ */
+struct extract_dir
+{
+    char *path;
+    struct inode inode;
+};
+
+struct extract_worker
+{
+    void *buf;
+    uint64_t files;
+    uint64_t bytes;
+};
+
+struct extract
+{
+    struct walk walk; // first, for visit()
+
+    pthread_mutex_t lock;
+    struct extract_dir *dir;
+    uint32_t dir_count;
+    uint32_t dir_max;
+
+    struct extract_worker w[WALK_MAX_THREADS];
+    uint64_t files;
+    uint64_t bytes;
+};
+
+struct extract_dir_priv
+{
+    struct walk *wk;
+    uint32_t id;
+    const char *path;
+};
+
+static int extract_each_de(struct ext4fs *e, void *priv, const struct dir_entry *de)
+{
+    struct extract_dir_priv *dir = priv;
+    char *path;
+
+    if (de->inode == 0)
+        return 0;
+    if ((de->name_len == 1 && de->name[0] == '.') ||
+        (de->name_len == 2 && de->name[0] == '.' && de->name[1] == '.'))
+        return 0;
+
+    if (asprintf(&path, "%s/%.*s", dir->path, de->name_len, de->name) < 0)
+        fatal("no mem for path.\n");
+    walk_push(dir->wk, dir->id, de->inode, path, NULL);
+
+    return 0;
+}
+
+// sets owner, mode and times. 'fd' is used if not negative.
+static void extract_attr(struct ext4fs *e, const char *path, int fd, const struct inode *inode)
+{
+    uid_t uid = ((uint32_t)inode->l_i_uid_high << 16) | inode->i_uid;
+    gid_t gid = ((uint32_t)inode->l_i_gid_high << 16) | inode->i_gid;
+    bool link = (inode->i_mode & 0xf000) == S_IFLNK;
+    struct timespec ts[2];
+    int r;
+
+    // only root can give files away. keep going without.
+    r = fd >= 0 ? fchown(fd, uid, gid) : fchownat(AT_FDCWD, path, uid, gid, AT_SYMLINK_NOFOLLOW);
+    if (r < 0)
+        debug("cannot change owner of \"%s\" to %u.%u\n", path, uid, gid);
+
+    if (!link)
+    {
+        r = fd >= 0 ? fchmod(fd, inode->i_mode & 07777) : chmod(path, inode->i_mode & 07777);
+        if (r < 0)
+            fatal("cannot change mode of \"%s\".\n", path);
+    }
+
+    ts[0] = inode_time(inode, inode->i_atime, inode->i_atime_extra, offsetof(struct inode, i_atime_extra));
+    ts[1] = inode_time(inode, inode->i_mtime, inode->i_mtime_extra, offsetof(struct inode, i_mtime_extra));
+    r = fd >= 0 ? futimens(fd, ts) : utimensat(AT_FDCWD, path, ts, AT_SYMLINK_NOFOLLOW);
+    if (r < 0)
+        fatal("cannot change times of \"%s\".\n", path);
+}
+
+static dev_t extract_dev(const struct inode *inode)
+{
+    const uint32_t *blk = (const uint32_t *)inode->i_block;
+
+    // old format in i_block[0], new format in i_block[1].
+    if (blk[0])
+        return makedev((blk[0] >> 8) & 0xff, blk[0] & 0xff);
+    return makedev((blk[1] & 0xfff00) >> 8, (blk[1] & 0xff) | ((blk[1] >> 12) & 0xfff00));
+}
+
+static void extract_one(struct walk *wk, uint32_t id, const struct walk_task *t)
+{
+    struct extract *x = (struct extract *)wk;
+    struct extract_worker *w = &x->w[id];
+    struct ext4fs *e = wk->e;
+    struct ext4fs_file *f;
+    int fd;
+
+    f = open_inode(e, t->inode_index);
+    debug("extract inode %u to \"%s\"\n", t->inode_index, t->path);
+
+    switch (f->inode.i_mode & 0xf000)
+    {
+    case S_IFDIR:
+    {
+        struct extract_dir_priv dir = {.wk = wk, .id = id, .path = t->path};
+
+        if (mkdir(t->path, 0700) < 0 && errno != EEXIST)
+            fatal("cannot make directory \"%s\".\n", t->path);
+
+        pthread_mutex_lock(&x->lock);
+        if (x->dir_count == x->dir_max)
+        {
+            x->dir_max = x->dir_max ? x->dir_max * 2 : 64;
+            x->dir = realloc(x->dir, x->dir_max * sizeof(x->dir[0]));
+            if (!x->dir)
+                fatal("no mem for directories. %u\n", x->dir_max);
+        }
+        x->dir[x->dir_count].path = strdup(t->path);
+        x->dir[x->dir_count].inode = f->inode;
+        x->dir_count++;
+        pthread_mutex_unlock(&x->lock);
+
+        foreach_dir(e, f->inode_index, &f->inode, extract_each_de, &dir);
+        break;
+    }
+
+    case S_IFREG:
+        fd = open(t->path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0)
+            fatal("cannot create \"%s\".\n", t->path);
+        w->bytes += copy_file(e, f, fd, w->buf, true);
+        extract_attr(e, t->path, fd, &f->inode);
+        close(fd);
+        break;
+
+    case S_IFLNK:
+    {
+        uint64_t size;
+        char *target;
+
+        target = read_inode_data(e, f->inode_index, &f->inode, &size);
+        target = realloc(target, size + 1);
+        if (!target)
+            fatal("no mem for link.\n");
+        target[size] = 0;
+        if (symlink(target, t->path) < 0)
+            fatal("cannot make link \"%s\".\n", t->path);
+        free(target);
+        extract_attr(e, t->path, -1, &f->inode);
+        break;
+    }
+
+    default:
+        // devices need privileges. others are fine.
+        if (mknod(t->path, f->inode.i_mode & 0xf000, extract_dev(&f->inode)) < 0)
+        {
+            debug("cannot make node \"%s\". mode 0%o\n", t->path, f->inode.i_mode);
+            break;
+        }
+        extract_attr(e, t->path, -1, &f->inode);
+        break;
+    }
+    w->files++;
+
+    ext4fs_close(f);
+}
+
+static int cmd_extract(struct ext4fs *e, char **argv)
+{
+    struct extract x = {.walk = {.e = e, .visit = extract_one}};
+    char *src = argv[0];
+    char *dest = argv[0] ? argv[1] : NULL;
+    struct inode inodebuf = {};
+    const struct inode *inode;
+    uint32_t inode_index;
+    char *path;
+    uint32_t i;
+
+    if (!src || !dest)
+        fatal("no source or destination.\n");
+
+    x.walk.nthreads = walk_threads(argv[2]);
+
+    inode_index = search_inode_index(e, src);
+    inode = read_inode(e, inode_index, &inodebuf);
+
+    // a directory becomes 'dest'. others are put into it.
+    if ((inode->i_mode & 0xf000) == S_IFDIR)
+        path = strdup(dest);
+    else
+    {
+        const char *name = strrchr(src, '/');
+
+        if (mkdir(dest, 0777) < 0 && errno != EEXIST)
+            fatal("cannot make directory \"%s\".\n", dest);
+        if (asprintf(&path, "%s/%s", dest, name ? name + 1 : src) < 0)
+            path = NULL;
+    }
+    if (!path)
+        fatal("no mem for path.\n");
+
+    pthread_mutex_init(&x.lock, NULL);
+    for (i = 0; i < x.walk.nthreads; i++)
+    {
+        x.w[i].buf = malloc(CAT_BUFFER_SIZE);
+        if (!x.w[i].buf)
+            fatal("no mem for extract buffer.\n");
+    }
+
+    walk_run(&x.walk, inode_index, path);
+
+    for (i = 0; i < x.walk.nthreads; i++)
+    {
+        free(x.w[i].buf);
+        x.files += x.w[i].files;
+        x.bytes += x.w[i].bytes;
+    }
+
+    // children first, so a read-only directory does not block its entries.
+    for (i = x.dir_count; i-- > 0;)
+    {
+        extract_attr(e, x.dir[i].path, -1, &x.dir[i].inode);
+        free(x.dir[i].path);
+    }
+    free(x.dir);
+    pthread_mutex_destroy(&x.lock);
+
+    printf("extracted %llu files, %llu bytes with %u threads.\n",
+           (unsigned long long)x.files, (unsigned long long)x.bytes, x.walk.nthreads);
+
+    return 0;
+}
+
+/* find.
+ *
+ * paths of matching entries are printed while the tree is walked. inodes of
+ * the entries of a directory are read with one batch. then first blocks of
+ * the child directories are read into the block cache with one batch too,
+ * before they are queued, so workers taking them find the blocks there.
+ */
+#define FIND_PREFETCH_BLOCKS 8           // blocks read ahead from each child directory
+#define FIND_PREFETCH_SIZE (1024 * 1024) // bytes read ahead at once
+#define FIND_SIZE_ANY 2
+
+struct find
 {
-#define EH_MAGIC 0xF30A
-    __le16 eh_magic;
-    __le16 eh_entries;
-    __le16 eh_max;
-    __le16 eh_depth;
-    __le32 eh_generation;
+    struct walk walk; // first, for visit()
+
+    const char *name; // -name pattern
+    uint32_t type;    // -type as S_IF*. 0 for any
+    int size_cmp;     // -size. -1, 0, 1 for less, equal, greater. or FIND_SIZE_ANY
+    uint64_t size;    // in size_unit bytes
+    uint64_t size_unit;
 };
 
-struct extent_idx
+static bool find_match(struct find *fd, const char *path, const struct inode *inode)
 {
-    __le32 ei_block;
-    __le32 ei_leaf_lo;
-    __le16 ei_leaf_hi;
-    __le16 ei_unused;
+    const char *name = strrchr(path, '/');
+
+    name = name && name[1] ? name + 1 : path;
+    if (fd->name && fnmatch(fd->name, name, 0) != 0)
+        return false;
+    if (fd->type && (inode->i_mode & 0xf000) != fd->type)
+        return false;
+    if (fd->size_cmp != FIND_SIZE_ANY)
+    {
+        // rounded up to units, as find(1) does.
+        uint64_t units = (get64(inode->i_size) + fd->size_unit - 1) / fd->size_unit;
+
+        if ((units < fd->size ? -1 : units > fd->size) != fd->size_cmp)
+            return false;
+    }
+
+    return true;
+}
+
+// reads first blocks of directories among 'inodes' into the block cache.
+static void prefetch_dirs(struct ext4fs *e, uint32_t count, const uint32_t *inode_index,
+                          const struct inode *inodes)
+{
+    struct ext4fs_read_req *req = NULL;
+    uint32_t req_count = 0, req_max = 0;
+    uint64_t used = 0;
+    uint8_t *buf;
+    uint32_t i, j;
+
+    // nowhere to keep them without cache. borrowed image needs no read.
+    if (!e->cache.enabled || e->borrow_cb)
+        return;
+
+    buf = malloc(FIND_PREFETCH_SIZE);
+    if (!buf)
+        fatal("no mem for prefetch.\n");
+
+    for (i = 0; i < count; i++)
+    {
+        uint64_t blocks = (get64(inodes[i].i_size) + e->block_size - 1) / e->block_size;
+        struct extmap m;
+
+        if ((inodes[i].i_mode & 0xf000) != S_IFDIR || (inodes[i].i_flags & EXT4_INLINE_DATA_FL))
+            continue;
+        if (blocks > FIND_PREFETCH_BLOCKS)
+            blocks = FIND_PREFETCH_BLOCKS;
+
+        extmap_init(e, &m, inode_index[i], &inodes[i]);
+        extmap_load(e, &m, 0, blocks);
+        for (j = extmap_first(&m, 0); j < m.count && m.ent[j].block_index < blocks; j++)
+        {
+            uint64_t len = blocks - m.ent[j].block_index;
+
+            if (len > m.ent[j].len)
+                len = m.ent[j].len;
+            len *= e->block_size;
+
+            if (used + len > FIND_PREFETCH_SIZE)
+            {
+                do_readv(e, req, req_count);
+                req_count = 0;
+                used = 0;
+            }
+            if (req_count == req_max)
+            {
+                req_max = req_max ? req_max * 2 : 64;
+                req = realloc(req, req_max * sizeof(req[0]));
+                if (!req)
+                    fatal("no mem for prefetch requests. %u\n", req_max);
+            }
+            req[req_count].offs = m.ent[j].phys * e->block_size;
+            req[req_count].data = buf + used;
+            req[req_count].size = len;
+            req_count++;
+            used += len;
+        }
+        extmap_free(&m);
+    }
+    if (req_count)
+        do_readv(e, req, req_count);
+
+    free(req);
+    free(buf);
+}
+
+static void find_one(struct walk *wk, uint32_t id, const struct walk_task *t)
+{
+    struct find *fd = (struct find *)wk;
+    struct ext4fs *e = wk->e;
+    struct inode inodebuf = {};
+    const struct inode *inode = t->inode;
+    struct list_priv list = {};
+    struct inode *inodes;
+    uint32_t i, n;
+
+    if (!inode)
+        inode = read_inode(e, t->inode_index, &inodebuf);
+    if (find_match(fd, t->path, inode))
+        printf("%s\n", t->path);
+    if ((inode->i_mode & 0xf000) != S_IFDIR)
+        return;
+
+    foreach_dir(e, t->inode_index, inode, list_each_de, &list);
+    for (i = 0, n = 0; i < list.count; i++)
+    {
+        if (!strcmp(list.name[i], ".") || !strcmp(list.name[i], ".."))
+        {
+            free(list.name[i]);
+            continue;
+        }
+        list.inode_index[n] = list.inode_index[i];
+        list.name[n++] = list.name[i];
+    }
+
+    inodes = calloc(n, sizeof(inodes[0]));
+    if (n && !inodes)
+        fatal("no mem for inodes. %u\n", n);
+    read_inodes(e, n, list.inode_index, inodes);
+    prefetch_dirs(e, n, list.inode_index, inodes);
+
+    // only directories are queued, backwards to be popped in directory order.
+    for (i = n; i-- > 0;)
+    {
+        struct inode *child;
+        char *path;
+
+        if (asprintf(&path, "%s/%s", strcmp(t->path, "/") ? t->path : "", list.name[i]) < 0)
+            fatal("no mem for path.\n");
+        free(list.name[i]);
+        if ((inodes[i].i_mode & 0xf000) != S_IFDIR)
+        {
+            if (find_match(fd, path, &inodes[i]))
+                printf("%s\n", path);
+            free(path);
+            continue;
+        }
+
+        child = malloc(sizeof(*child));
+        if (!child)
+            fatal("no mem for inode.\n");
+        *child = inodes[i];
+        walk_push(wk, id, list.inode_index[i], path, child);
+    }
+
+    free(inodes);
+    free(list.inode_index);
+    free(list.name);
+}
+
+// find <path> [-name <pattern>] [-type <bcdflps>] [-size [+-]<n>[bcwkMG]] [-j <threads>]
+static int cmd_find(struct ext4fs *e, char **argv)
+{
+    struct find fd = {.walk = {.e = e, .visit = find_one}, .size_cmp = FIND_SIZE_ANY};
+    const char *threads = NULL;
+    uint32_t inode_index;
+    char *path;
+    int i;
+
+    if (!argv[0])
+        fatal("no path\n");
+
+    for (i = 1; argv[i]; i += 2)
+    {
+        const char *v = argv[i + 1];
+
+        if (!v)
+            fatal("no value for \"%s\".\n", argv[i]);
+
+        if (!strcmp(argv[i], "-name"))
+            fd.name = v;
+        else if (!strcmp(argv[i], "-type"))
+        {
+            static const uint32_t modes[] = {S_IFBLK, S_IFCHR, S_IFDIR, S_IFREG, S_IFLNK, S_IFIFO, S_IFSOCK};
+            const char *t = strchr("bcdflps", v[0]);
+
+            if (!v[0] || !t)
+                fatal("unknown type \"%s\".\n", v);
+            fd.type = modes[t - "bcdflps"];
+        }
+        else if (!strcmp(argv[i], "-size"))
+        {
+            static const int shifts[] = {9, 9, 0, 1, 10, 20, 30};
+            const char *u;
+            char *unit;
+
+            fd.size_cmp = *v == '+' ? 1 : *v == '-' ? -1 : 0;
+            if (*v == '+' || *v == '-')
+                v++;
+            fd.size = strtoull(v, &unit, 10);
+            // no unit is 512 byte blocks.
+            u = strchr(" bcwkMG", *unit ? *unit : ' ');
+            if (!u || (*unit && unit[1]))
+                fatal("unknown size \"%s\".\n", argv[i + 1]);
+            fd.size_unit = 1ull << shifts[u - " bcwkMG"];
+        }
+        else if (!strcmp(argv[i], "-j"))
+            threads = v;
+        else
+            fatal("unknown find option \"%s\".\n", argv[i]);
+    }
+
+    inode_index = search_inode_index(e, argv[0]);
+    path = strdup(argv[0]);
+    if (!path)
+        fatal("no mem for path.\n");
+    // "/dir/" prints as "/dir/name" like "/dir".
+    for (i = strlen(path); i > 1 && path[i - 1] == '/'; i--)
+        path[i - 1] = 0;
+
+    fd.walk.nthreads = walk_threads(threads);
+    walk_run(&fd.walk, inode_index, path);
+
+    return 0;
+}
+
+/* all entries of a tree, parents before children. */
+struct tree_entry
+{
+    char *path;
+    uint32_t inode_index;
+    uint16_t mode;
+    uint64_t size;
 };
 
-struct extent
+struct tree
 {
-    __le32 ee_block;
-    __le16 ee_len;
-    __le16 ee_start_hi;
-    __le32 ee_start_lo;
+    struct tree_entry *ent;
+    uint32_t count;
+    uint32_t max;
 };
 
-static void dump_eh(struct ext4fs *e, struct extent_header *eh)
+static void collect_tree(struct ext4fs *e, struct tree *t, const char *path, uint32_t inode_index)
 {
-#define print_eh(m) debug("(%01x) eh->%-28s= 0x%0*llx(%llu)\n",              \
-                          (int)(long)&((struct extent_header *)NULL)->m, #m, \
-                          sizeof(eh->m) * 2,                                 \
-                          (long long)eh->m, (long long)eh->m)
-    print_eh(eh_magic);
-    print_eh(eh_entries);
-    print_eh(eh_max);
-    print_eh(eh_depth);
-    print_eh(eh_generation);
-#undef print_eh
+    struct inode inodebuf = {};
+    const struct inode *inode;
+    struct tree_entry *ent;
+    uint32_t i;
+
+    inode = read_inode(e, inode_index, &inodebuf);
+
+    if (t->count == t->max)
+    {
+        t->max = t->max ? t->max * 2 : 64;
+        t->ent = realloc(t->ent, t->max * sizeof(t->ent[0]));
+        if (!t->ent)
+            fatal("no mem for tree. %u\n", t->max);
+    }
+    ent = &t->ent[t->count++];
+    ent->path = strdup(path);
+    if (!ent->path)
+        fatal("no mem for path.\n");
+    ent->inode_index = inode_index;
+    ent->mode = inode->i_mode;
+    ent->size = get64(inode->i_size);
+
+    if ((inode->i_mode & 0xf000) == S_IFDIR)
+    {
+        struct list_priv dir = {};
+
+        foreach_dir(e, inode_index, inode, list_each_de, &dir);
+        for (i = 0; i < dir.count; i++)
+        {
+            char *child;
+
+            if (strcmp(dir.name[i], ".") && strcmp(dir.name[i], ".."))
+            {
+                if (asprintf(&child, "%s/%s", strcmp(path, "/") ? path : "", dir.name[i]) < 0)
+                    fatal("no mem for path.\n");
+                collect_tree(e, t, child, dir.inode_index[i]);
+                free(child);
+            }
+            free(dir.name[i]);
+        }
+        free(dir.name);
+        free(dir.inode_index);
+    }
 }
 
-static void dump_ei(struct ext4fs *e, struct extent_idx *ei)
+static void free_tree(struct tree *t)
 {
-#define print_ei(m) debug("(%01x) ee->%-28s= 0x%0*llx(%llu)\n",           \
-                          (int)(long)&((struct extent_idx *)NULL)->m, #m, \
-                          sizeof(ei->m) * 2,                              \
-                          (long long)ei->m, (long long)ei->m)
-    print_ei(ei_block);
-    print_ei(ei_leaf_lo);
-    print_ei(ei_leaf_hi);
-#undef print_ee
+    uint32_t i;
+
+    for (i = 0; i < t->count; i++)
+        free(t->ent[i].path);
+    free(t->ent);
+    memset(t, 0, sizeof(*t));
+}
+
+/* stress.
+ *
+ * all regular files are read once to get checksums of their chunks. then
+ * threads open random files by path and read random chunks back in random
+ * sized pieces, sharing the one loaded 'e'. a mismatch is fatal.
+ */
+#define STRESS_CHUNK (64 * 1024)
+
+struct stress_file
+{
+    char *path;
+    uint64_t size;
+    uint64_t *sum; // per chunk
+};
+
+struct stress
+{
+    struct ext4fs *e;
+    struct stress_file *file;
+    uint32_t count;
+    uint32_t max;
+    uint32_t *nonempty; // indexes of files with data
+    uint32_t nonempty_count;
+    uint32_t rounds;
+};
+
+struct stress_worker
+{
+    struct stress *s;
+    pthread_t thread;
+    unsigned int seed;
+    uint64_t opens;
+    uint64_t bytes;
+};
+
+static uint64_t stress_sum(uint64_t sum, const uint8_t *data, uint64_t size)
+{
+    uint64_t i;
+
+    // FNV-1a
+    for (i = 0; i < size; i++)
+        sum = (sum ^ data[i]) * 0x100000001b3ull;
+
+    return sum;
 }
 
-static void dump_ee(struct ext4fs *e, struct extent *ee)
+// reads a chunk in pieces of random size.
+static uint64_t stress_read(struct ext4fs_file *f, void *buf, uint32_t chunk, unsigned int *seed)
 {
-#define print_ee(m) debug("(%01x) ee->%-28s= 0x%0*llx(%llu)\n",       \
-                          (int)(long)&((struct extent *)NULL)->m, #m, \
-                          sizeof(ee->m) * 2,                          \
-                          (long long)ee->m, (long long)ee->m)
-    print_ee(ee_block);
-    print_ee(ee_len);
-    print_ee(ee_start_hi);
-    print_ee(ee_start_lo);
-#undef print_ee
+    uint64_t sum = 0xcbf29ce484222325ull;
+    uint64_t offs = (uint64_t)chunk * STRESS_CHUNK;
+    uint64_t end = offs + STRESS_CHUNK;
+    uint64_t got;
+
+    while (offs < end)
+    {
+        uint64_t size = 1 + rand_r(seed) % (end - offs);
+
+        got = ext4fs_pread(f, buf, size, offs);
+        if (got == 0)
+            break;
+        sum = stress_sum(sum, buf, got);
+        offs += got;
+    }
+
+    return sum;
 }
 
-static uint64_t read_data(struct ext4fs *e, struct extent_header *eh, struct extent *ee,
-                          void *data, uint64_t remaining_size,
-                          uint32_t start_block_index, uint32_t offset_in_block)
+static void stress_collect(struct stress *s, void *buf)
 {
-    uint64_t copied = 0;
-    int i;
+    struct ext4fs *e = s->e;
+    struct tree t = {};
+    unsigned int seed = 0;
+    uint32_t i, j;
+
+    collect_tree(e, &t, "/", 2);
 
-    for (i = 0; i < eh->eh_entries; i++)
+    for (i = 0; i < t.count; i++)
     {
-        uint64_t data_offset;
-        uint64_t read_size;
+        struct stress_file *sf;
+        struct ext4fs_file *f;
+        uint64_t chunks;
 
-        dump_ee(e, ee);
+        if ((t.ent[i].mode & 0xf000) != S_IFREG)
+            continue;
 
-        if (start_block_index < ee->ee_block + ee->ee_len)
+        if (s->count == s->max)
         {
-            if (ee->ee_block < start_block_index)
-                offset_in_block += e->block_size * (start_block_index - ee->ee_block);
+            s->max = s->max ? s->max * 2 : 64;
+            s->file = realloc(s->file, s->max * sizeof(s->file[0]));
+            if (!s->file)
+                fatal("no mem for files. %u\n", s->max);
+        }
+        sf = &s->file[s->count++];
+        sf->path = strdup(t.ent[i].path);
+        sf->size = t.ent[i].size;
+        chunks = (sf->size + STRESS_CHUNK - 1) / STRESS_CHUNK;
+        sf->sum = malloc(chunks * sizeof(sf->sum[0]) + 1);
+        if (!sf->path || !sf->sum)
+            fatal("no mem for file.\n");
+
+        f = open_inode(e, t.ent[i].inode_index);
+        for (j = 0; j < chunks; j++)
+            sf->sum[j] = stress_read(f, buf, j, &seed);
+        ext4fs_close(f);
+    }
+
+    free_tree(&t);
+}
 
-            read_size = ee->ee_len * e->block_size - offset_in_block;
-            if (read_size > remaining_size)
-                read_size = remaining_size;
+static void *stress_worker(void *arg)
+{
+    struct stress_worker *w = arg;
+    struct stress *s = w->s;
+    struct ext4fs *e = s->e;
+    void *buf;
+    uint32_t r;
 
-            data_offset = get64(ee->ee_start) * e->block_size;
-            debug("read data size %llu from 0x%08llx\n", read_size, data_offset + offset_in_block);
-            do_read(e, data_offset + offset_in_block, data + copied, read_size);
-            remaining_size -= read_size;
-            copied += read_size;
-            offset_in_block = 0;
+    buf = malloc(STRESS_CHUNK);
+    if (!buf)
+        fatal("no mem for stress buffer.\n");
 
-            if (remaining_size == 0)
-                break;
-        }
+    for (r = 0; r < s->rounds; r++)
+    {
+        const struct stress_file *sf;
+        struct ext4fs_file *f;
+        char *missing;
+
+        // every other round reads a file with data.
+        if ((r & 1) && s->nonempty_count)
+            sf = &s->file[s->nonempty[rand_r(&w->seed) % s->nonempty_count]];
+        else
+            sf = &s->file[rand_r(&w->seed) % s->count];
+
+        f = ext4fs_open(e, sf->path);
+        if (!f)
+            fatal("cannot search \"%s\".\n", sf->path);
+        if (sf->size)
+        {
+            uint32_t chunk = rand_r(&w->seed) % ((sf->size + STRESS_CHUNK - 1) / STRESS_CHUNK);
 
-        ee++;
+            if (stress_read(f, buf, chunk, &w->seed) != sf->sum[chunk])
+                fatal("\"%s\" read differently. chunk %u\n", sf->path, chunk);
+            w->bytes += sf->size - (uint64_t)chunk * STRESS_CHUNK < STRESS_CHUNK ?
+                            sf->size - (uint64_t)chunk * STRESS_CHUNK : STRESS_CHUNK;
+        }
+        else if (ext4fs_pread(f, buf, 1, 0))
+            fatal("\"%s\" is not empty.\n", sf->path);
+        ext4fs_close(f);
+        w->opens++;
+
+        // negative lookups too.
+        if (asprintf(&missing, "%s.missing%u", sf->path, r % 16) < 0)
+            fatal("no mem for path.\n");
+        if (lookup_path(e, missing))
+            fatal("found \"%s\".\n", missing);
+        free(missing);
     }
 
-    return copied;
+    free(buf);
+    return NULL;
 }
 
-static uint64_t read_eh(struct ext4fs *e, struct extent_header *eh,
-                        void *data, uint64_t remaining_size,
-                        uint32_t start_block_index, uint32_t offset_in_block)
+static int cmd_stress(struct ext4fs *e, char **argv)
 {
-    uint64_t copied = 0;
+    struct stress_worker w[WALK_MAX_THREADS] = {};
+    struct stress s = {.e = e, .rounds = 100};
+    uint32_t nthreads = 4;
+    uint64_t opens = 0, bytes = 0;
+    void *buf;
+    uint32_t i;
+
+    if (argv[0])
+    {
+        nthreads = strtoul(argv[0], NULL, 0);
+        if (argv[1])
+            s.rounds = strtoul(argv[1], NULL, 0);
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > WALK_MAX_THREADS)
+        nthreads = WALK_MAX_THREADS;
+
+    buf = malloc(STRESS_CHUNK);
+    if (!buf)
+        fatal("no mem for stress buffer.\n");
+    stress_collect(&s, buf);
+    free(buf);
+    if (s.count == 0)
+        fatal("no files to read.\n");
+
+    s.nonempty = malloc(s.count * sizeof(s.nonempty[0]));
+    if (!s.nonempty)
+        fatal("no mem for files. %u\n", s.count);
+    for (i = 0; i < s.count; i++)
+        if (s.file[i].size)
+            s.nonempty[s.nonempty_count++] = i;
+
+    for (i = 0; i < nthreads; i++)
+    {
+        w[i].s = &s;
+        w[i].seed = i + 1;
+        if (pthread_create(&w[i].thread, NULL, stress_worker, &w[i]))
+            fatal("cannot create thread.\n");
+    }
+    for (i = 0; i < nthreads; i++)
+    {
+        pthread_join(w[i].thread, NULL);
+        opens += w[i].opens;
+        bytes += w[i].bytes;
+    }
 
-    debug("start_block_index 0x%08x, offset_in_block 0x%08x\n", start_block_index, offset_in_block);
-    dump_eh(e, eh);
-    if (eh->eh_magic != EH_MAGIC)
-        fatal("wrong eh_magic. 0x%04x\n", eh->eh_magic);
+    for (i = 0; i < s.count; i++)
+    {
+        free(s.file[i].path);
+        free(s.file[i].sum);
+    }
+    free(s.file);
+    free(s.nonempty);
 
-    if (eh->eh_depth == 0)
-        return read_data(e, eh, (void *)&eh[1], data, remaining_size,
-                start_block_index, offset_in_block);
+    printf("stress ok. %u threads, %u files, %llu opens, %llu bytes.\n",
+           nthreads, s.count, (unsigned long long)opens, (unsigned long long)bytes);
+
+    return 0;
+}
 
+/* bench.
+ *
+ * times metadata paths over the whole tree: path lookups, inode reads,
+ * directory walks and extent maps. compare runs with and without -d to see
+ * what logging costs.
+ */
+struct scan_count
+{
+    bool list;
+    uint64_t inodes;
+    uint64_t types[16]; // by i_mode >> 12
+    uint64_t bytes;
+};
+
+static int scan_count_each(void *priv, const struct ext4fs_inode *inodes, uint32_t count)
+{
+    struct scan_count *sc = priv;
+    uint32_t i;
+
+    for (i = 0; i < count; i++)
     {
-        int i;
-        struct extent_idx *ei = (void *)&eh[1];
-        uint32_t leafbuf[e->block_size / 4];
+        if (sc->list)
+            printf("%10u %06o %5u %12llu\n", inodes[i].inode, inodes[i].mode, inodes[i].links,
+                   (long long)inodes[i].size);
+        sc->types[(inodes[i].mode >> 12) & 0xf]++;
+        sc->bytes += inodes[i].size;
+    }
+    sc->inodes += count;
+
+    return 0;
+}
+
+// scan [-l]. counts used inodes by type, reading inode tables in order.
+static int cmd_scan(struct ext4fs *e, char **argv)
+{
+    struct scan_count sc = {};
+
+    sc.list = argv[0] && !strcmp(argv[0], "-l");
+    ext4fs_scan(e, scan_count_each, &sc);
+
+    printf("%llu inodes. %llu files, %llu directories, %llu links, %llu others. %llu bytes.\n",
+           (long long)sc.inodes, (long long)sc.types[S_IFREG >> 12], (long long)sc.types[S_IFDIR >> 12],
+           (long long)sc.types[S_IFLNK >> 12],
+           (long long)(sc.inodes - sc.types[S_IFREG >> 12] - sc.types[S_IFDIR >> 12] - sc.types[S_IFLNK >> 12]),
+           (long long)sc.bytes);
+
+    return 0;
+}
+
+/* analyze.
+ *
+ * workers take block groups in turn. free blocks and inodes are counted from
+ * bitmaps and checked against the descriptors. free extents inside a group go
+ * to a histogram by length. those touching the group ends are joined with the
+ * neighbor groups afterwards, as extents cross groups. extents of regular
+ * files are counted while the group's inodes are scanned.
+ */
+#define ANALYZE_HIST 33 // power of two buckets
+
+struct analyze_group
+{
+    uint32_t blocks;      // in the group
+    uint32_t free_blocks; // by bitmap
+    uint32_t free_inodes;
+    uint32_t head;        // free blocks from the group start
+    uint32_t tail;        // free blocks to the group end
+};
+
+struct analyze_worker
+{
+    struct analyze *a;
+    pthread_t thread;
+    struct scan sc;
+
+    uint64_t free_count[ANALYZE_HIST]; // free extents inside groups
+    uint64_t free_blocks[ANALYZE_HIST];
+    uint64_t largest;
+    uint64_t files[ANALYZE_HIST + 1];  // files by extents. 0 extents first
+    uint64_t extents;
+    uint64_t max_extents;
+};
+
+struct analyze
+{
+    struct ext4fs *e;
+    uint32_t next_group;
+    struct analyze_group *group;
+    uint32_t block_uninit;
+};
+
+static int hist_bucket(uint64_t n)
+{
+    int b = 63 - __builtin_clzll(n);
+
+    return b < ANALYZE_HIST ? b : ANALYZE_HIST - 1;
+}
 
-        for (i = 0; i < eh->eh_entries; i++)
+// first bit at or after 'i' which is 'set', or 'nbits'.
+static uint32_t find_bit(const uint8_t *bitmap, uint32_t nbits, uint32_t i, bool set)
+{
+    while (i < nbits)
+    {
+        if (i % 64 == 0 && i + 64 <= nbits)
         {
-            struct extent_header *leaf_eh;
-            bool check_next = false;
+            uint64_t w;
+
+            memcpy(&w, bitmap + i / 8, 8);
+            if (!set)
+                w = ~w;
+            if (w)
+                return i + __builtin_ctzll(w);
+            i += 64;
+            continue;
+        }
+        if (test_bit(bitmap, i) == set)
+            return i;
+        i++;
+    }
 
-            dump_ei(e, ei);
+    return nbits;
+}
 
-            if (start_block_index <= ei->ei_block)
-                check_next = true;
-            else if (i + 1 == eh->eh_entries)
-                check_next = true;
-            else if (start_block_index < ei[1].ei_block)
-                check_next = true;
+static void analyze_free_runs(struct analyze_worker *w, const uint8_t *bitmap, struct analyze_group *ag)
+{
+    uint32_t i = 0;
 
-            if (check_next)
-            {
-                do_read(e, get64(ei->ei_leaf) * e->block_size, leafbuf, e->block_size);
+    while (i < ag->blocks)
+    {
+        uint32_t start = find_bit(bitmap, ag->blocks, i, false);
+        uint32_t end;
 
-                leaf_eh = (void *)leafbuf;
-                copied += read_eh(e, leaf_eh, data + copied, remaining_size,
-                        start_block_index, offset_in_block);
-                remaining_size -= copied;
-            }
+        if (start == ag->blocks)
+            break;
+        end = find_bit(bitmap, ag->blocks, start, true);
 
-            ei++;
+        if (start == 0)
+            ag->head = end;
+        if (end == ag->blocks)
+            ag->tail = end - start;
+        if (start && end < ag->blocks)
+        {
+            w->free_count[hist_bucket(end - start)]++;
+            w->free_blocks[hist_bucket(end - start)] += end - start;
+            if (end - start > w->largest)
+                w->largest = end - start;
         }
+        i = end;
+    }
+}
+
+static int analyze_each_ee(struct ext4fs *e, void *priv, const struct extent *ee)
+{
+    (*(uint64_t *)priv)++;
+    return 0;
+}
+
+static int analyze_each_inode(struct ext4fs *e, void *priv, uint32_t inode_index, const struct inode *inode)
+{
+    struct analyze_worker *w = priv;
+    uint64_t n = 0;
+
+    // resize and journal inodes are regular files, but not in the tree.
+    if ((inode->i_mode & 0xf000) != S_IFREG || inode_index < e->sb.s_first_ino)
+        return 0;
+
+    foreach_extent(e, inode_index, inode, analyze_each_ee, &n);
+    w->files[n ? hist_bucket(n) + 1 : 0]++;
+    w->extents += n;
+    if (n > w->max_extents)
+        w->max_extents = n;
+
+    return 0;
+}
+
+static void analyze_group(struct analyze_worker *w, uint32_t group)
+{
+    struct ext4fs *e = w->a->e;
+    struct analyze_group *ag = &w->a->group[group];
+    const struct bg_info *bg = get_bg(e, group);
+    uint64_t blocks = get64(e->sb.s_blocks_count) - e->sb.s_first_data_block -
+                      (uint64_t)group * e->sb.s_blocks_per_group;
+    uint32_t ipg = e->sb.s_inodes_per_group;
+    uint8_t buf[e->block_size];
+    const uint8_t *bitmap;
+
+    ag->blocks = blocks < e->sb.s_blocks_per_group ? blocks : e->sb.s_blocks_per_group;
+
+    // not initialized bitmap. group metadata is at the start, if in the group.
+    if (bg->flags & EXT4_BG_BLOCK_UNINIT)
+    {
+        __atomic_add_fetch(&w->a->block_uninit, 1, __ATOMIC_RELAXED);
+        ag->free_blocks = bg->free_blocks_count;
+        ag->tail = ag->free_blocks;
+        if (ag->free_blocks == ag->blocks)
+            ag->head = ag->blocks;
+    }
+    else
+    {
+        bitmap = read_ptr(e, bg->block_bitmap * e->block_size, buf, (ag->blocks + 7) / 8);
+        ag->free_blocks = ag->blocks - popcount(bitmap, ag->blocks);
+        analyze_free_runs(w, bitmap, ag);
+    }
+
+    if (bg->flags & EXT4_BG_INODE_UNINIT)
+        ag->free_inodes = ipg;
+    else
+    {
+        bitmap = read_ptr(e, bg->inode_bitmap * e->block_size, buf, (ipg + 7) / 8);
+        ag->free_inodes = ipg - popcount(bitmap, ipg);
     }
 
-    return copied;
+    scan_group(e, &w->sc, group);
 }
 
-static void *read_inode_data(struct ext4fs *e, struct inode *inode, uint64_t *size)
+static void *analyze_worker(void *arg)
 {
-    void *data;
-    uint64_t data_size;
+    struct analyze_worker *w = arg;
+    uint32_t group;
 
-    *size = data_size = get64(inode->i_size);
-    data = malloc(data_size);
-    if (!data)
-        fatal("no memory for data. %llu\n", (long long)data_size);
+    while ((group = __atomic_fetch_add(&w->a->next_group, 1, __ATOMIC_RELAXED)) < w->a->e->bg_count)
+        analyze_group(w, group);
+
+    return NULL;
+}
 
-    if (((inode->i_mode & 0xf000) == S_IFLNK) && data_size < 60)
+static void analyze_range(char *buf, size_t size, int b)
+{
+    if (b == ANALYZE_HIST - 1)
+        snprintf(buf, size, "%llu-", 1ull << b);
+    else if (b == 0)
+        snprintf(buf, size, "1");
+    else
+        snprintf(buf, size, "%llu-%llu", 1ull << b, (2ull << b) - 1);
+}
+
+// analyze [threads]. free space and fragmentation.
+static int cmd_analyze(struct ext4fs *e, char **argv)
+{
+    struct analyze_worker w[WALK_MAX_THREADS] = {};
+    struct analyze a = {.e = e};
+    uint64_t free_count[ANALYZE_HIST] = {}, free_blocks[ANALYZE_HIST] = {};
+    uint64_t files[ANALYZE_HIST + 1] = {};
+    uint64_t bitmap_free = 0, desc_free = 0, bitmap_ifree = 0, desc_ifree = 0;
+    uint64_t extents = 0, max_extents = 0, nfiles = 0, nfree = 0, largest = 0, carry = 0;
+    uint32_t nthreads = walk_threads(argv[0]);
+    uint32_t mismatch = 0;
+    uint32_t i, b;
+    char range[32];
+
+    a.group = calloc(e->bg_count, sizeof(a.group[0]));
+    if (!a.group)
+        fatal("no mem for groups. %u\n", e->bg_count);
+
+    for (i = 0; i < nthreads; i++)
+    {
+        w[i].a = &a;
+        w[i].sc.each = analyze_each_inode;
+        w[i].sc.priv = &w[i];
+        w[i].sc.buf = malloc(INODE_BATCH_SIZE + 2 * e->block_size);
+        if (!w[i].sc.buf)
+            fatal("no mem for inode scan.\n");
+        if (pthread_create(&w[i].thread, NULL, analyze_worker, &w[i]))
+            fatal("cannot create thread.\n");
+    }
+    for (i = 0; i < nthreads; i++)
     {
-        memcpy(data, &inode->i_block[0], data_size);
-        return data;
+        pthread_join(w[i].thread, NULL);
+        free(w[i].sc.buf);
+        for (b = 0; b < ANALYZE_HIST; b++)
+        {
+            free_count[b] += w[i].free_count[b];
+            free_blocks[b] += w[i].free_blocks[b];
+        }
+        for (b = 0; b <= ANALYZE_HIST; b++)
+            files[b] += w[i].files[b];
+        extents += w[i].extents;
+        if (w[i].largest > largest)
+            largest = w[i].largest;
+        if (w[i].max_extents > max_extents)
+            max_extents = w[i].max_extents;
     }
 
-    // if extents
-    if (inode->i_flags & EXT4_EXTENTS_FL)
+    for (i = 0; i < e->bg_count; i++)
     {
-        struct extent_header *eh = (void *)&inode->i_block[0];
+        const struct bg_info *bg = get_bg(e, i);
+        struct analyze_group *ag = &a.group[i];
 
-        if (eh->eh_magic != EH_MAGIC)
-            fatal("wrong eh_magic. 0x%04x\n", eh->eh_magic);
+        if (ag->free_blocks != bg->free_blocks_count || ag->free_inodes != bg->free_inodes_count)
+        {
+            if (mismatch++ < 8)
+                printf("group %u: %u free blocks, %u free inodes. descriptor says %u, %u.\n",
+                       i, ag->free_blocks, ag->free_inodes, bg->free_blocks_count, bg->free_inodes_count);
+        }
+        bitmap_free += ag->free_blocks;
+        desc_free += bg->free_blocks_count;
+        bitmap_ifree += ag->free_inodes;
+        desc_ifree += bg->free_inodes_count;
 
-        read_eh(e, eh, data, data_size, 0, 0);
+        // joins free extents across group ends.
+        if (ag->head == ag->blocks)
+        {
+            carry += ag->blocks;
+            continue;
+        }
+        if (carry + ag->head)
+        {
+            free_count[hist_bucket(carry + ag->head)]++;
+            free_blocks[hist_bucket(carry + ag->head)] += carry + ag->head;
+            if (carry + ag->head > largest)
+                largest = carry + ag->head;
+        }
+        carry = ag->tail;
     }
-    else
-        fatal("reading non extent inode data is not implemented.\n");
+    if (carry)
+    {
+        free_count[hist_bucket(carry)]++;
+        free_blocks[hist_bucket(carry)] += carry;
+        if (carry > largest)
+            largest = carry;
+    }
+    for (b = 0; b < ANALYZE_HIST; b++)
+        nfree += free_count[b];
+    for (b = 0; b <= ANALYZE_HIST; b++)
+        nfiles += files[b];
+
+    printf("%u groups, %u with block bitmap not initialized. %u groups differ from descriptors.\n",
+           e->bg_count, a.block_uninit, mismatch);
+    printf("blocks %llu, free %llu (%.1f%%). descriptors %llu, superblock %llu.\n",
+           (long long)get64(e->sb.s_blocks_count), (long long)bitmap_free,
+           100.0 * bitmap_free / get64(e->sb.s_blocks_count), (long long)desc_free,
+           (long long)get64(e->sb.s_free_blocks_count));
+    printf("inodes %u, free %llu. descriptors %llu, superblock %u.\n",
+           e->sb.s_inodes_count, (long long)bitmap_ifree, (long long)desc_ifree, e->sb.s_free_inodes_count);
+    printf("free extents %llu, average %.1f blocks, largest %llu. bitmaps counted with %s.\n",
+           (long long)nfree, nfree ? (double)bitmap_free / nfree : 0.0, (long long)largest, popcount_name);
+    printf("%16s %12s %14s\n", "free blocks", "extents", "blocks");
+    for (b = 0; b < ANALYZE_HIST; b++)
+        if (free_count[b])
+        {
+            analyze_range(range, sizeof(range), b);
+            printf("%16s %12llu %14llu\n", range, (long long)free_count[b], (long long)free_blocks[b]);
+        }
 
-    debug("got data size 0x%08llx\n", data_size);
+    printf("regular files %llu, extents %llu, average %.2f, most %llu. %.1f%% have more than one.\n",
+           (long long)nfiles, (long long)extents, nfiles ? (double)extents / nfiles : 0.0,
+           (long long)max_extents, nfiles ? 100.0 * (nfiles - files[0] - files[1]) / nfiles : 0.0);
+    printf("%16s %12s\n", "extents", "files");
+    for (b = 0; b <= ANALYZE_HIST; b++)
+        if (files[b])
+        {
+            if (b == 0)
+                snprintf(range, sizeof(range), "0");
+            else
+                analyze_range(range, sizeof(range), b - 1);
+            printf("%16s %12llu\n", range, (long long)files[b]);
+        }
 
-    return data;
+    free(a.group);
+
+    return 0;
 }
 
-struct dir_entry
+static uint64_t bench_now(void)
 {
-    __le32 inode;
-    __le16 rec_len;
-    __u8 name_len;
-    __u8 file_type;
-    char name[0];
-};
+    struct timespec ts;
 
-/* each_de() returns
- *  0    : continue for next dir_entry.
- *  != 0 : stop for futher loop.
- *
- * each_de() should ignore directory entries which is (de->inode == 0)
- */
-static void foreach_dir(struct ext4fs *e, struct inode *inode,
-                        int (*each_de)(struct ext4fs *e, void *priv, struct dir_entry *de),
-                        void *priv)
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int bench_each_de(struct ext4fs *e, void *priv, const struct dir_entry *de)
 {
-    uint64_t i;
-    uint64_t size;
-    void *data;
+    uint64_t *count = priv;
 
-    if (!(inode->i_mode & S_IFDIR))
-        fatal("not directory\n");
+    if (de->inode)
+        (*count)++;
+    return 0;
+}
 
-    // if (inode->i_flags & EXT4_INDEX_FL)
-    //     fatal("hashed directory index. not implemented.\n");
+static void bench_print(const char *name, uint64_t ops, uint64_t ns)
+{
+    printf("%-8s %10llu ops %12.1f ns/op\n", name, (unsigned long long)ops,
+           ops ? (double)ns / ops : 0.0);
+}
 
-    data = read_inode_data(e, inode, &size);
-    for (i = 0; i < size;)
+static int cmd_bench(struct ext4fs *e, char **argv)
+{
+    struct tree t = {};
+    uint32_t rounds = 10;
+    uint64_t start, ops, entries = 0;
+    uint32_t r, i;
+
+    if (argv[0])
+        rounds = strtoul(argv[0], NULL, 0);
+
+    start = bench_now();
+    collect_tree(e, &t, "/", 2);
+    bench_print("walk", t.count, bench_now() - start);
+
+    start = bench_now();
+    for (r = 0, ops = 0; r < rounds; r++)
+        for (i = 0; i < t.count; i++, ops++)
+            if (lookup_path(e, t.ent[i].path) != t.ent[i].inode_index)
+                fatal("\"%s\" is not inode %u.\n", t.ent[i].path, t.ent[i].inode_index);
+    bench_print("lookup", ops, bench_now() - start);
+
+    start = bench_now();
+    for (r = 0, ops = 0; r < rounds; r++)
+        for (i = 0; i < t.count; i++, ops++)
+        {
+            struct inode inodebuf;
+
+            read_inode(e, t.ent[i].inode_index, &inodebuf);
+        }
+    bench_print("inode", ops, bench_now() - start);
+
+    start = bench_now();
+    for (r = 0, ops = 0; r < rounds; r++)
     {
-        struct dir_entry *de = (void *)(data + i);
+        struct scan_count sc = {};
+
+        ext4fs_scan(e, scan_count_each, &sc);
+        ops += sc.inodes;
+    }
+    bench_print("scan", ops, bench_now() - start);
 
-        if (de->inode)
+    start = bench_now();
+    for (r = 0, ops = 0; r < rounds; r++)
+        for (i = 0; i < t.count; i++)
         {
-            debug("de offset %lld\n", i);
-            debug("de->inode     0x%08x\n", de->inode);
-            debug("de->rec_len   0x%04x\n", de->rec_len);
-            debug("de->name_len  0x%02x\n", de->name_len);
-            debug("de->file_type 0x%02x\n", de->file_type);
-            debug("de->name      \"%.*s\"\n", de->name_len, de->name);
+            struct inode inodebuf = {};
+            const struct inode *inode;
+
+            if ((t.ent[i].mode & 0xf000) != S_IFDIR)
+                continue;
+            inode = read_inode(e, t.ent[i].inode_index, &inodebuf);
+            foreach_dir(e, t.ent[i].inode_index, inode, bench_each_de, &entries);
+            ops++;
         }
+    bench_print("readdir", ops, bench_now() - start);
 
-        if (each_de && each_de(e, priv, de) != 0)
-            break;
+    start = bench_now();
+    for (r = 0, ops = 0; r < rounds; r++)
+        for (i = 0; i < t.count; i++)
+        {
+            struct ext4fs_file *f;
+
+            if ((t.ent[i].mode & 0xf000) != S_IFREG)
+                continue;
+            f = open_inode(e, t.ent[i].inode_index);
+            extmap_load(e, &f->extmap, 0, (uint64_t)UINT32_MAX + 1);
+            ext4fs_close(f);
+            ops++;
+        }
+    bench_print("extent", ops, bench_now() - start);
 
-        i += de->rec_len;
-    }
-    free(data);
+    free_tree(&t);
+
+    return 0;
 }
 
-struct search_inode_priv
+struct ext4fs_file *ext4fs_open(struct ext4fs *e, const char *path)
 {
-    char *searching;
     uint32_t inode_index;
-};
 
-static int search_inode_index_each_de(struct ext4fs *e, void *priv, struct dir_entry *de)
+    inode_index = lookup_path(e, path);
+    if (inode_index == 0)
+        return NULL;
+
+    return open_inode(e, inode_index);
+}
+
+uint64_t ext4fs_pread(struct ext4fs_file *f, void *data, uint64_t size, uint64_t offs)
 {
-    struct search_inode_priv *search = priv;
+    struct ext4fs *e = f->e;
+    uint64_t file_size = get64(f->inode.i_size);
 
-    if (de->inode == 0)
+    if (offs >= file_size)
         return 0;
+    if (size > file_size - offs)
+        size = file_size - offs;
 
-    debug("searching \"%s\", this \"%.*s\"\n", search->searching,
-          de->name_len, de->name);
-    if (!strncmp(search->searching, de->name, de->name_len) &&
-        search->searching[de->name_len] == 0)
-    {
-        search->inode_index = de->inode;
-        debug("same. inode_index %d\n", de->inode);
-        return 1;
-    }
+    read_inode_range(e, &f->inode, &f->extmap, data, size, offs);
 
-    return 0;
+    return size;
 }
 
-static uint32_t search_inode_index(struct ext4fs *e, const char *filename)
+uint64_t ext4fs_preadv(struct ext4fs_file *f, const struct iovec *iov, int iovcnt, uint64_t offs)
 {
-    char *str = strdup(filename);
-    char *tok;
-    uint32_t inode_index = 2; // start from root inode index
-
-    tok = strtok(str, "/");
-    while (tok)
-    {
-        struct search_inode_priv search = {};
-        struct inode inode = {};
+    struct ext4fs *e = f->e;
+    uint64_t file_size = get64(f->inode.i_size);
+    uint64_t size = 0;
+    int i;
 
-        debug("tok \"%s\"\n", tok);
-        search.searching = tok;
-        read_inode(e, inode_index, &inode);
-        foreach_dir(e, &inode, search_inode_index_each_de, &search);
+    for (i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
 
-        if (search.inode_index == 0)
-            fatal("cannot search \"%s\".\n", tok);
+    if (offs >= file_size)
+        return 0;
+    if (size > file_size - offs)
+        size = file_size - offs;
 
-        inode_index = search.inode_index;
-        tok = strtok(NULL, "/");
-    }
+    read_inode_rangev(e, &f->inode, &f->extmap, iov, iovcnt, size, offs);
 
-    free(str);
-    debug("inode index %d\n", inode_index);
-    return inode_index;
+    return size;
 }
 
-static void printf_inode(struct ext4fs *e, struct inode *inode, uint32_t inode_index,
-                         const char *name, uint32_t name_len)
+bool ext4fs_map(struct ext4fs_file *f, uint64_t offs, struct ext4fs_map *map)
 {
-    char ftype;
+    struct ext4fs *e = f->e;
+    uint64_t file_size = get64(f->inode.i_size);
+    struct block_map bm = {};
+    uint32_t block_index;
+    uint64_t offset_in_block;
 
-    switch (inode->i_mode & 0xf000)
+    memset(map, 0, sizeof(*map));
+    if (offs >= file_size)
+        return false;
+
+    if (f->extmap.inline_data)
     {
-    case S_IFIFO:
-        ftype = 'f';
-        break;
-    case S_IFCHR:
-        ftype = 'c';
-        break;
-    case S_IFDIR:
-        ftype = 'd';
-        break;
-    case S_IFBLK:
-        ftype = 'b';
-        break;
-    case S_IFREG:
-        ftype = '-';
-        break;
-    case S_IFLNK:
-        ftype = 'l';
-        break;
-    case S_IFSOCK:
-        ftype = 's';
-        break;
-    default:
-        ftype = '?';
-        break;
+        map->offs = offs;
+        map->size = file_size - offs;
+        map->flags |= EXT4FS_MAP_INLINE;
+        return true;
     }
 
-    printf("%7d %c%c%c%c%c%c%c%c%c%c %4d.%-4d %8llu %-.*s",
-           inode_index, ftype,
-           inode->i_mode & S_IRUSR ? 'r' : '-',
-           inode->i_mode & S_IWUSR ? 'w' : '-',
-           inode->i_mode & S_IXUSR ? 'x' : '-',
-           inode->i_mode & S_IRGRP ? 'r' : '-',
-           inode->i_mode & S_IWGRP ? 'w' : '-',
-           inode->i_mode & S_IXGRP ? 'x' : '-',
-           inode->i_mode & S_IROTH ? 'r' : '-',
-           inode->i_mode & S_IWOTH ? 'w' : '-',
-           inode->i_mode & S_IXOTH ? 'x' : '-',
-           inode->i_uid, inode->i_gid,
-           (long long)get64(inode->i_size),
-           name_len, name);
+    block_index = offs / e->block_size;
+    offset_in_block = offs % e->block_size;
 
-    if ((inode->i_mode & 0xf000) == S_IFLNK)
+    extmap_lookup(e, &f->extmap, block_index, &bm);
+
+    /* blocks replayed from the journal are not at 'phys'. the map ends before
+     * the first of them, or covers a run of them without 'phys'.
+     */
+    if (bm.phys)
     {
-        void *data;
-        uint64_t data_size;
+        uint32_t j = journal_first(e, bm.phys);
+        uint32_t n;
 
-        data = read_inode_data(e, inode, &data_size);
-        printf(" -> %.*s", (unsigned int)data_size, (char *)data);
-        free(data);
+        if (j < e->journal_count && e->journal[j].blk == bm.phys)
+        {
+            for (n = 1; n < bm.len && j + n < e->journal_count &&
+                        e->journal[j + n].blk == bm.phys + n;)
+                n++;
+            bm.len = n;
+            map->flags |= EXT4FS_MAP_JOURNAL;
+        }
+        else if (j < e->journal_count && e->journal[j].blk < bm.phys + bm.len)
+            bm.len = e->journal[j].blk - bm.phys;
     }
-    printf("\n");
+
+    map->offs = offs;
+    map->size = (uint64_t)bm.len * e->block_size - offset_in_block;
+    if (map->size > file_size - offs)
+        map->size = file_size - offs;
+    if (!bm.phys)
+        map->flags |= EXT4FS_MAP_HOLE;
+    else if (!(map->flags & EXT4FS_MAP_JOURNAL))
+        map->phys = bm.phys * e->block_size + offset_in_block;
+
+    return true;
 }
 
-static int list_each_de(struct ext4fs *e, void *priv, struct dir_entry *de)
+int64_t ext4fs_seek_data(struct ext4fs_file *f, uint64_t offs)
 {
-    struct inode inode = {};
-    uint32_t *entry_count = priv;
+    struct ext4fs_map map;
 
-    if (de->inode == 0)
-        return 0;
+    while (ext4fs_map(f, offs, &map))
+    {
+        if (!(map.flags & EXT4FS_MAP_HOLE))
+            return offs;
+        offs += map.size;
+    }
 
-    read_inode(e, de->inode, &inode);
-    printf_inode(e, &inode, de->inode, de->name, de->name_len);
+    return -1;
+}
 
-    (*entry_count)++;
+int64_t ext4fs_seek_hole(struct ext4fs_file *f, uint64_t offs)
+{
+    struct ext4fs_map map;
 
-    return 0;
+    if (offs >= get64(f->inode.i_size))
+        return -1;
+
+    while (ext4fs_map(f, offs, &map))
+    {
+        if (map.flags & EXT4FS_MAP_HOLE)
+            return offs;
+        offs += map.size;
+    }
+
+    return offs;
 }
 
-static int cmd_list(struct ext4fs *e, char **argv)
+int ext4fs_scan(struct ext4fs *e, ext4fs_scan_cb_t cb, void *priv)
 {
-    char *file = argv[0];
-    uint32_t inode_index;
-    struct inode inode = {};
+    struct scan *sc;
+    uint32_t group;
+    int ret = 0;
 
-    if (!file)
-        file = "/";
+    sc = calloc(1, sizeof(*sc));
+    if (sc)
+        sc->buf = malloc(INODE_BATCH_SIZE + 2 * e->block_size);
+    if (!sc || !sc->buf)
+        fatal("no mem for inode scan.\n");
+    sc->cb = cb;
+    sc->priv = priv;
 
-    inode_index = search_inode_index(e, file);
-    debug("inode index %d\n", inode_index);
+    for (group = 0; group < e->bg_count && ret == 0; group++)
+        ret = scan_group(e, sc, group);
 
-    read_inode(e, inode_index, &inode);
-    if (inode.i_mode & S_IFDIR)
-    {
-        uint32_t entry_count = 0;
+    free(sc->buf);
+    free(sc);
 
-        printf("listing directory. \"%s\"...\n", file);
-        foreach_dir(e, &inode, list_each_de, &entry_count);
-        printf("all %u files.\n", entry_count);
-    }
-    else
-        printf_inode(e, &inode, inode_index, file, strlen(file));
+    return ret;
+}
 
-    return 0;
+void ext4fs_close(struct ext4fs_file *f)
+{
+    extmap_free(&f->extmap);
+    free(f);
 }
 
-static int cmd_cat(struct ext4fs *e, char **argv)
+struct ext4fs_dir *ext4fs_opendir(struct ext4fs *e, const char *path)
 {
-    char *file = argv[0];
-    void *data;
-    uint64_t size;
-    struct inode inode = {};
-    int r;
+    uint32_t inode_index;
 
-    if (!file)
-        fatal("no file\n");
+    inode_index = lookup_path(e, path);
+    if (inode_index == 0)
+        return NULL;
 
-    read_inode(e, search_inode_index(e, file), &inode);
-    data = read_inode_data(e, &inode, &size);
+    return open_dir(e, inode_index);
+}
 
-    r = write(1, data, size);
-    if (r < 0)
-        fatal("write() failed.\n");
+const struct ext4fs_dirent *ext4fs_readdir(struct ext4fs_dir *d)
+{
+    return read_dir(d->f->e, d);
+}
 
-    free(data);
+uint64_t ext4fs_telldir(struct ext4fs_dir *d)
+{
+    return d->pos;
+}
 
-    return 0;
+void ext4fs_seekdir(struct ext4fs_dir *d, uint64_t pos)
+{
+    d->pos = pos;
+    d->synced = false;
+}
+
+void ext4fs_closedir(struct ext4fs_dir *d)
+{
+    close_dir(d);
 }
 
 int ext4fs_load(struct ext4fs *e)
 {
     read_sb(e);
-    read_bg(e);
+    bg_init(e);
+    // superblock and descriptors are read again, through the journal.
+    if (journal_load(e))
+    {
+        bg_free(e);
+        read_sb(e);
+        bg_init(e);
+    }
+    cache_init(e);
+    dcache_init(e);
 
     return 0;
 }
@@ -976,9 +6584,30 @@ int ext4fs_command(struct ext4fs *e, char **argv)
     if (!strcmp(argv[0], "list"))
         return cmd_list(e, argv + 1);
 
+    if (!strcmp(argv[0], "readdir"))
+        return cmd_readdir(e, argv + 1);
+
     if (!strcmp(argv[0], "cat"))
         return cmd_cat(e, argv + 1);
 
+    if (!strcmp(argv[0], "extract"))
+        return cmd_extract(e, argv + 1);
+
+    if (!strcmp(argv[0], "stress"))
+        return cmd_stress(e, argv + 1);
+
+    if (!strcmp(argv[0], "find"))
+        return cmd_find(e, argv + 1);
+
+    if (!strcmp(argv[0], "analyze"))
+        return cmd_analyze(e, argv + 1);
+
+    if (!strcmp(argv[0], "scan"))
+        return cmd_scan(e, argv + 1);
+
+    if (!strcmp(argv[0], "bench"))
+        return cmd_bench(e, argv + 1);
+
     fatal("unknown command. \"%s\"\n", argv[0]);
     return 0;
 }
@@ -988,7 +6617,82 @@ void ext4fs_set_read_callback(struct ext4fs *e, ext4fs_read_cb_t read_cb)
     e->read_cb = read_cb;
 }
 
+void ext4fs_set_readv_callback(struct ext4fs *e, ext4fs_readv_cb_t readv_cb)
+{
+    e->readv_cb = readv_cb;
+}
+
+void ext4fs_set_borrow_callback(struct ext4fs *e, ext4fs_borrow_cb_t borrow_cb)
+{
+    e->borrow_cb = borrow_cb;
+}
+
+void ext4fs_set_copy_callback(struct ext4fs *e, ext4fs_copy_cb_t copy_cb)
+{
+    e->copy_cb = copy_cb;
+}
+
 void ext4fs_set_message_callback(struct ext4fs *e, ext4fs_message_cb_t message_cb)
 {
     e->message_cb = message_cb;
 }
+
+void ext4fs_set_log_level(struct ext4fs *e, int level)
+{
+    e->log_level = level;
+}
+
+void ext4fs_set_cache_size(struct ext4fs *e, uint64_t size)
+{
+    e->cache.size = size;
+}
+
+void ext4fs_set_dcache_size(struct ext4fs *e, uint32_t entries)
+{
+    e->dcache.max = entries;
+}
+
+void ext4fs_set_verify(struct ext4fs *e, bool verify)
+{
+    e->verify = verify;
+}
+
+void ext4fs_set_journal(struct ext4fs *e, bool replay)
+{
+    e->journal_replay = replay;
+}
+
+void ext4fs_get_stats(struct ext4fs *e, struct ext4fs_stats *stats)
+{
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+
+    stats->read_batches = __atomic_load_n(&e->read_batches, __ATOMIC_RELAXED);
+    stats->reads = __atomic_load_n(&e->reads, __ATOMIC_RELAXED);
+    stats->read_bytes = __atomic_load_n(&e->read_bytes, __ATOMIC_RELAXED);
+    stats->csum_checks = __atomic_load_n(&e->csum_checks, __ATOMIC_RELAXED);
+    stats->csum_cached = __atomic_load_n(&e->csum_cached, __ATOMIC_RELAXED);
+    stats->journal_transactions = e->journal_transactions;
+    stats->journal_blocks = e->journal_count;
+
+    pthread_mutex_lock(&e->dcache.lock);
+    stats->dcache_hits = e->dcache.hits;
+    stats->dcache_misses = e->dcache.misses;
+    stats->dcache_entries = e->dcache.count;
+    pthread_mutex_unlock(&e->dcache.lock);
+
+    if (!e->cache.enabled)
+        return;
+
+    for (i = 0; i < CACHE_SHARDS; i++)
+    {
+        struct cache_shard *s = &e->cache.shard[i];
+
+        pthread_mutex_lock(&s->lock);
+        stats->cache_hits += s->hits;
+        stats->cache_misses += s->misses;
+        stats->cache_bytes += s->bytes;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
@@ -3,17 +3,182 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/uio.h>
+
+// message levels. see ext4fs_set_log_level().
+#define EXT4FS_LOG_FATAL 0 // errors the library cannot go on with. always sent.
+#define EXT4FS_LOG_DEBUG 1 // what the library does.
+#define EXT4FS_LOG_DUMP 2  // on-disk structures, field by field.
 
 typedef void (*ext4fs_message_cb_t)(void *priv, bool fat, const char *func, int line, const char *fmt, ...);
 typedef void (*ext4fs_read_cb_t)(void *priv, uint64_t offs, void *data, uint32_t size);
 
+struct ext4fs_read_req
+{
+    uint64_t offs;
+    void *data;
+    uint32_t size;
+};
+
+/* optional. reads all 'count' requests, in any order. without it, read_cb is
+ * called for each request.
+ */
+typedef void (*ext4fs_readv_cb_t)(void *priv, const struct ext4fs_read_req *req, uint32_t count);
+
+/* optional. returns pointer to 'size' bytes of image at 'offs', or NULL if the
+ * range cannot be lent. the memory should stay valid until ext4fs_del().
+ */
+typedef const void *(*ext4fs_borrow_cb_t)(void *priv, uint64_t offs, uint32_t size);
+
+/* optional. copies 'size' bytes of image at 'offs' to file descriptor 'fd'.
+ * returns 0 on success. on failure, nothing should have been written and the
+ * library copies the range through a buffer instead.
+ */
+typedef int (*ext4fs_copy_cb_t)(void *priv, uint64_t offs, uint64_t size, int fd);
+
+/* after ext4fs_load(), one 'struct ext4fs' can be shared by threads. callbacks
+ * may then be called from several threads at once. a 'struct ext4fs_file' is
+ * a cursor for one thread at a time.
+ */
 struct ext4fs;
+struct ext4fs_file;
+struct ext4fs_dir;
+
+// file range and where it is in the image. see ext4fs_map().
+struct ext4fs_map
+{
+#define EXT4FS_MAP_HOLE 0x1 // no data in the image. reads as zero.
+#define EXT4FS_MAP_INLINE 0x2 // kept in the inode. 'phys' is not set. read with ext4fs_pread().
+#define EXT4FS_MAP_JOURNAL 0x4 // replayed from the journal. 'phys' is not set. read with ext4fs_pread().
+    uint64_t offs; // offset in file
+    uint64_t size;
+    uint64_t phys; // offset in image
+    uint32_t flags;
+};
+
+// directory entry. see ext4fs_readdir().
+struct ext4fs_dirent
+{
+    uint32_t inode;
+    uint8_t file_type; // 1 file, 2 directory, 7 symlink and so on. 0 without filetype feature.
+    uint8_t name_len;
+    char name[256];    // null terminated
+};
+
+// decoded inode. see ext4fs_scan().
+struct ext4fs_inode
+{
+    uint32_t inode; // inode number
+    uint32_t mode;  // type and permissions, as st_mode
+    uint32_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t flags;
+    uint32_t generation;
+    uint64_t size;
+    uint64_t blocks; // i_blocks. 512 byte units, unless huge_file flags say
+    int64_t atime;   // seconds since epoch
+    int64_t mtime;
+    int64_t ctime;
+};
+
+// returns non-zero to stop the scan.
+typedef int (*ext4fs_scan_cb_t)(void *priv, const struct ext4fs_inode *inodes, uint32_t count);
+
+struct ext4fs_stats
+{
+    // requests to the image, through read_cb or readv_cb. one readv_cb call is
+    // one batch.
+    uint64_t read_batches;
+    uint64_t reads;
+    uint64_t read_bytes;
+
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_bytes;
+
+    uint64_t dcache_hits;
+    uint64_t dcache_misses;
+    uint64_t dcache_entries;
+
+    // metadata checksums computed, and skipped as the cached block was verified.
+    uint64_t csum_checks;
+    uint64_t csum_cached;
+
+    // committed transactions and blocks replayed from the journal at load.
+    uint64_t journal_transactions;
+    uint64_t journal_blocks;
+};
 
 struct ext4fs *ext4fs_new(void *priv);
 void ext4fs_del(struct ext4fs *e);
 void ext4fs_set_read_callback(struct ext4fs *e, ext4fs_read_cb_t read_cb);
+void ext4fs_set_readv_callback(struct ext4fs *e, ext4fs_readv_cb_t readv_cb);
+void ext4fs_set_borrow_callback(struct ext4fs *e, ext4fs_borrow_cb_t borrow_cb);
+void ext4fs_set_copy_callback(struct ext4fs *e, ext4fs_copy_cb_t copy_cb);
 void ext4fs_set_message_callback(struct ext4fs *e, ext4fs_message_cb_t message_cb);
+/* messages up to 'level' are sent to message_cb. EXT4FS_LOG_FATAL by default.
+ * levels above EXT4FS_LOG_LEVEL, if defined at build, are never sent.
+ */
+void ext4fs_set_log_level(struct ext4fs *e, int level);
+// block cache byte budget. should be set before ext4fs_load(). 0 disables.
+void ext4fs_set_cache_size(struct ext4fs *e, uint64_t size);
+// dentry cache entries. should be set before ext4fs_load(). 0 disables.
+void ext4fs_set_dcache_size(struct ext4fs *e, uint32_t entries);
+/* verifies crc32c of superblock, group descriptors, inodes, extent tree and
+ * directory blocks of metadata_csum filesystems. mismatch is fatal. should be
+ * set before ext4fs_load(). off by default.
+ */
+void ext4fs_set_verify(struct ext4fs *e, bool verify);
+/* if the filesystem needs recovery, committed transactions in its journal are
+ * read over the blocks they update, as if replayed. nothing is written.
+ * should be set before ext4fs_load(). on by default.
+ */
+void ext4fs_set_journal(struct ext4fs *e, bool replay);
+void ext4fs_get_stats(struct ext4fs *e, struct ext4fs_stats *stats);
 int ext4fs_load(struct ext4fs *e);
 int ext4fs_command(struct ext4fs *e, char **argv);
+/* calls 'cb' with all used inodes, in batches, by inode number order. inode
+ * tables are read group by group in large requests, skipping unused parts by
+ * inode bitmaps and bg_itable_unused. returns non-zero value of 'cb' which
+ * stopped the scan, or 0.
+ */
+int ext4fs_scan(struct ext4fs *e, ext4fs_scan_cb_t cb, void *priv);
+
+// returns NULL if 'path' does not exist.
+struct ext4fs_file *ext4fs_open(struct ext4fs *e, const char *path);
+// returns bytes read. 0 at end of file. holes read as zero.
+uint64_t ext4fs_pread(struct ext4fs_file *f, void *data, uint64_t size, uint64_t offs);
+// same as ext4fs_pread(), scattering into 'iovcnt' buffers.
+uint64_t ext4fs_preadv(struct ext4fs_file *f, const struct iovec *iov, int iovcnt, uint64_t offs);
+/* maps the longest file range from 'offs' which is contiguous in the image, or
+ * a hole. blocks replayed from the journal (see ext4fs_set_journal()) are
+ * mapped apart, flagged EXT4FS_MAP_JOURNAL. returns false at end of file.
+ */
+bool ext4fs_map(struct ext4fs_file *f, uint64_t offs, struct ext4fs_map *map);
+/* like lseek() with SEEK_DATA and SEEK_HOLE. returns offset of the first data,
+ * or hole, at or after 'offs'. holes and unwritten extents are holes, and end
+ * of file is one. returns -1 if there is no data after 'offs', or 'offs' is at
+ * or beyond end of file.
+ */
+int64_t ext4fs_seek_data(struct ext4fs_file *f, uint64_t offs);
+int64_t ext4fs_seek_hole(struct ext4fs_file *f, uint64_t offs);
+void ext4fs_close(struct ext4fs_file *f);
+
+/* directory cursor, reading one directory block at a time. returns NULL if
+ * 'path' does not exist or is not a directory. for one thread at a time, as
+ * 'struct ext4fs_file'.
+ */
+struct ext4fs_dir *ext4fs_opendir(struct ext4fs *e, const char *path);
+/* returns next entry, including "." and "..", or NULL at end. the entry stays
+ * valid until the next call.
+ */
+const struct ext4fs_dirent *ext4fs_readdir(struct ext4fs_dir *d);
+/* position of the next entry. ext4fs_seekdir() resumes there, also with
+ * another cursor of the same directory.
+ */
+uint64_t ext4fs_telldir(struct ext4fs_dir *d);
+void ext4fs_seekdir(struct ext4fs_dir *d, uint64_t pos);
+void ext4fs_closedir(struct ext4fs_dir *d);
 
 #endif
\ No newline at end of file
@@ -2,6 +2,12 @@
 #define _GNU_SOURCE
 
 #include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,6 +16,8 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "ext4.h"
 
@@ -25,12 +33,56 @@
         _message(__func__, __LINE__, fmt, ##args); \
     } while (0)
 
+struct uring
+{
+    int fd;
+    uint32_t depth;
+
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_mask;
+    uint32_t *sq_array;
+    struct io_uring_sqe *sqes;
+
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    struct uring *next;
+};
+
 struct fsimage
 {
     int fd;
     void *priv;
+
+    // set if the image is mapped. (-m)
+    uint8_t *map;
+    uint64_t map_size;
+
+    // set if reads go through io_uring. (-u) each thread gets its own ring.
+    uint32_t ring_depth;
+    pthread_mutex_t ring_lock;
+    struct uring *rings;
+
+    // set if the image is an android sparse image. raw chunk ranges are read
+    // with 'image_read' and 'image_readv', one of the above.
+    struct sparse_chunk *chunks;
+    uint32_t chunk_count;
+    uint64_t sparse_size; // expanded
+    ext4fs_read_cb_t image_read;
+    ext4fs_readv_cb_t image_readv;
 };
 
+static __thread struct uring *thread_ring;
+
 static void _fatal(const char *func, int line, const char *fmt, ...)
 {
     va_list ap;
@@ -48,36 +100,345 @@ static void
 read_cb(void *priv, uint64_t offs, void *data, uint32_t size)
 {
     struct fsimage *i = priv;
-    off_t off;
     ssize_t got;
 
-    off = lseek(i->fd, offs, SEEK_SET);
-    if (off == (off_t)-1)
-        fatal("lseek() failed. offs %llu\n", offs);
-
-    got = read(i->fd, data, size);
+    got = pread(i->fd, data, size, offs);
     if (got == -1)
-        fatal("read() failed.\n");
+        fatal("pread() failed. offs %llu\n", (unsigned long long)offs);
 
     if (got != size)
-        fatal("read() failed. got %z, requested %u\n", got, size);
+        fatal("pread() failed. got %zd, requested %u\n", got, size);
+}
+
+static int cmp_read_req(const void *a, const void *b)
+{
+    const struct ext4fs_read_req *x = a;
+    const struct ext4fs_read_req *y = b;
+
+    return x->offs < y->offs ? -1 : x->offs > y->offs;
+}
+
+/* requests are sorted, and each run of adjacent ones in the image is read with
+ * one preadv(), scattering into their buffers.
+ */
+static void
+preadv_cb(void *priv, const struct ext4fs_read_req *req, uint32_t count)
+{
+    struct fsimage *i = priv;
+    struct ext4fs_read_req *sorted;
+    struct iovec iov[IOV_MAX];
+    uint32_t n, k;
+
+    sorted = malloc(count * sizeof(sorted[0]));
+    if (!sorted)
+        fatal("no mem for requests. %u\n", count);
+    memcpy(sorted, req, count * sizeof(sorted[0]));
+    qsort(sorted, count, sizeof(sorted[0]), cmp_read_req);
+
+    for (n = 0; n < count; n += k)
+    {
+        uint64_t end = sorted[n].offs;
+        uint64_t total = 0;
+        ssize_t got;
+
+        for (k = 0; n + k < count && k < IOV_MAX && sorted[n + k].offs == end; k++)
+        {
+            iov[k].iov_base = sorted[n + k].data;
+            iov[k].iov_len = sorted[n + k].size;
+            end += sorted[n + k].size;
+            total += sorted[n + k].size;
+        }
+
+        got = preadv(i->fd, iov, k, sorted[n].offs);
+        if (got == -1)
+            fatal("preadv() failed. offs %llu\n", (unsigned long long)sorted[n].offs);
+
+        // short read. reads the rest one by one.
+        if ((uint64_t)got != total)
+        {
+            uint32_t j;
+
+            for (j = 0; j < k; j++)
+            {
+                if ((uint64_t)got >= iov[j].iov_len)
+                {
+                    got -= iov[j].iov_len;
+                    continue;
+                }
+                read_cb(priv, sorted[n + j].offs + got, (uint8_t *)iov[j].iov_base + got,
+                        iov[j].iov_len - got);
+                got = 0;
+            }
+        }
+    }
+
+    free(sorted);
+}
+
+static void
+map_read_cb(void *priv, uint64_t offs, void *data, uint32_t size)
+{
+    struct fsimage *i = priv;
+
+    if (offs > i->map_size || size > i->map_size - offs)
+        fatal("read out of image. offs %llu, size %u\n", (unsigned long long)offs, size);
+
+    memcpy(data, i->map + offs, size);
+}
+
+static const void *
+map_borrow_cb(void *priv, uint64_t offs, uint32_t size)
+{
+    struct fsimage *i = priv;
+
+    if (offs > i->map_size || size > i->map_size - offs)
+        return NULL;
+
+    return i->map + offs;
+}
+
+static struct uring *uring_new(uint32_t depth)
+{
+    struct io_uring_params p = {};
+    struct uring *r;
+
+    r = calloc(1, sizeof(*r));
+    if (!r)
+        fatal("no mem for io_uring.\n");
+
+    r->fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (r->fd < 0)
+        fatal("io_uring_setup() failed.\n");
+    r->depth = p.sq_entries;
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED)
+        fatal("mmap() for io_uring failed.\n");
+
+    r->sq_head = r->sq_ring + p.sq_off.head;
+    r->sq_tail = r->sq_ring + p.sq_off.tail;
+    r->sq_mask = r->sq_ring + p.sq_off.ring_mask;
+    r->sq_array = r->sq_ring + p.sq_off.array;
+
+    r->cq_head = r->cq_ring + p.cq_off.head;
+    r->cq_tail = r->cq_ring + p.cq_off.tail;
+    r->cq_mask = r->cq_ring + p.cq_off.ring_mask;
+    r->cqes = r->cq_ring + p.cq_off.cqes;
+
+    return r;
+}
+
+static void uring_del(struct uring *r)
+{
+    munmap(r->sqes, r->sqes_size);
+    munmap(r->cq_ring, r->cq_ring_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    free(r);
+}
+
+static void uring_queue_read(struct uring *r, int fd, uint64_t offs, void *data,
+                             uint32_t size, uint64_t user_data)
+{
+    uint32_t tail = *r->sq_tail;
+    uint32_t index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = offs;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = size;
+    sqe->user_data = user_data;
+
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* keeps up to 'depth' reads in flight until all requests are done. short
+ * reads are queued again for the remaining part, and submitted with the next
+ * io_uring_enter().
+ */
+static void
+uring_readv_cb(void *priv, const struct ext4fs_read_req *req, uint32_t count)
+{
+    struct fsimage *i = priv;
+    struct uring *r = thread_ring;
+    uint32_t done_size[count];
+    uint32_t next = 0, inflight = 0, completed = 0;
+    uint32_t to_submit = 0; // queued, not yet taken by the kernel
+
+    memset(done_size, 0, sizeof(done_size));
+
+    if (!r)
+    {
+        r = thread_ring = uring_new(i->ring_depth);
+        pthread_mutex_lock(&i->ring_lock);
+        r->next = i->rings;
+        i->rings = r;
+        pthread_mutex_unlock(&i->ring_lock);
+    }
+
+    while (completed < count)
+    {
+        uint32_t head, tail;
+        int ret;
+
+        while (next < count && inflight < r->depth)
+        {
+            uring_queue_read(r, i->fd, req[next].offs, req[next].data, req[next].size, next);
+            next++;
+            inflight++;
+            to_submit++;
+        }
+
+        ret = syscall(__NR_io_uring_enter, r->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR)
+            fatal("io_uring_enter() failed.\n");
+        if (ret > 0)
+            to_submit -= ret;
+
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            uint32_t n = cqe->user_data;
+
+            if (cqe->res < 0)
+            {
+                errno = -cqe->res;
+                fatal("read failed. offs %llu\n", (unsigned long long)req[n].offs);
+            }
+            if (cqe->res == 0)
+                fatal("read failed. unexpected end of image. offs %llu\n",
+                      (unsigned long long)(req[n].offs + done_size[n]));
+
+            done_size[n] += cqe->res;
+            if (done_size[n] < req[n].size)
+            {
+                uring_queue_read(r, i->fd, req[n].offs + done_size[n], req[n].data + done_size[n],
+                                 req[n].size - done_size[n], n);
+                to_submit++;
+            }
+            else
+            {
+                inflight--;
+                completed++;
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+static void
+uring_read_cb(void *priv, uint64_t offs, void *data, uint32_t size)
+{
+    struct ext4fs_read_req req = {.offs = offs, .data = data, .size = size};
+
+    uring_readv_cb(priv, &req, 1);
+}
+
+/* copies image range to 'fd' in kernel. copy_file_range() works between
+ * regular files, sendfile() for most outputs, splice() for pipes. if none of
+ * them can start, the library copies through a buffer.
+ */
+static int
+copy_cb(void *priv, uint64_t offs, uint64_t size, int fd)
+{
+    struct fsimage *i = priv;
+    enum
+    {
+        COPY_FILE_RANGE,
+        SENDFILE,
+        SPLICE,
+        COPY_NONE,
+    };
+    static __thread int method = COPY_FILE_RANGE;
+    loff_t in_off = offs;
+    bool started = false;
+
+    while (size && method != COPY_NONE)
+    {
+        ssize_t r;
+
+        switch (method)
+        {
+        case COPY_FILE_RANGE:
+            r = copy_file_range(i->fd, &in_off, fd, NULL, size, 0);
+            break;
+        case SENDFILE:
+            r = sendfile(fd, i->fd, &in_off, size);
+            break;
+        default:
+            r = splice(i->fd, &in_off, fd, NULL, size, SPLICE_F_MOVE);
+            break;
+        }
+
+        if (r > 0)
+        {
+            started = true;
+            size -= r;
+            continue;
+        }
+
+        if (r == 0)
+            fatal("unexpected end of image. offs %llu\n", (unsigned long long)in_off);
+        if (errno == EINTR || errno == EAGAIN)
+            continue;
+        if (started)
+            fatal("copy to output failed. offs %llu\n", (unsigned long long)in_off);
+
+        // this method does not work for these files. try next one.
+        method++;
+    }
+
+    return size ? -1 : 0;
+}
+
+static void map_image(struct fsimage *i, const char *filename)
+{
+    off_t size;
+
+    size = lseek(i->fd, 0, SEEK_END);
+    if (size == (off_t)-1)
+        fatal("cannot get size of %s.\n", filename);
+
+    i->map = mmap(NULL, size, PROT_READ, MAP_SHARED, i->fd, 0);
+    if (i->map == MAP_FAILED)
+        fatal("mmap(%s) failed.\n", filename);
+    i->map_size = size;
+
+    madvise(i->map, i->map_size, MADV_RANDOM);
 }
 
+// set once before any thread starts.
 static FILE *debug_file;
 
-static void _vmessage(const char *func, int line, const char *format, va_list ap)
+static void _vmessage(FILE *file, const char *func, int line, const char *format, va_list ap)
 {
     char *str = NULL;
     int ret;
 
-    if (!debug_file)
+    if (!file)
         return;
 
     ret = vasprintf(&str, format, ap);
     if (ret < 0)
         fatal("vasprintf() failed.\n");
 
-    fprintf(debug_file, "%24s %4d : %s", func, line, str);
+    // one call per line, so lines from threads do not mix.
+    fprintf(file, "%24s %4d : %s", func, line, str);
     free(str);
 }
 
@@ -86,7 +447,7 @@ static void _message(const char *func, int line, const char *format, ...)
     va_list ap;
 
     va_start(ap, format);
-    _vmessage(func, line, format, ap);
+    _vmessage(debug_file, func, line, format, ap);
     va_end(ap);
 }
 
@@ -94,29 +455,323 @@ static void message_cb(void *priv, bool fat, const char *func, int line, const c
 {
     va_list ap;
 
-    if (fat)
-        debug_file = stderr;
-
     va_start(ap, format);
-    _vmessage(func, line, format, ap);
+    _vmessage(fat ? stderr : debug_file, func, line, format, ap);
     va_end(ap);
 
     if (fat)
         exit(1);
 }
 
-static struct ext4fs *e;
+/* android sparse image.
+ *
+ * the header is followed by chunks of blocks. raw chunks hold their data, fill
+ * chunks a 4 byte value repeated, and don't care chunks nothing, read as zero.
+ * chunk headers are indexed at open, and reads are translated by binary
+ * search. the image is never expanded.
+ */
+#define SPARSE_HEADER_MAGIC 0xed26ff3a
+#define CHUNK_TYPE_RAW 0xcac1
+#define CHUNK_TYPE_FILL 0xcac2
+#define CHUNK_TYPE_DONT_CARE 0xcac3
+#define CHUNK_TYPE_CRC32 0xcac4
+
+struct sparse_header
+{
+    uint32_t magic;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint16_t file_hdr_sz;
+    uint16_t chunk_hdr_sz;
+    uint32_t blk_sz;
+    uint32_t total_blks;
+    uint32_t total_chunks;
+    uint32_t image_checksum;
+};
+
+struct sparse_chunk_header
+{
+    uint16_t chunk_type;
+    uint16_t reserved1;
+    uint32_t chunk_sz; // blocks
+    uint32_t total_sz; // bytes, with this header
+};
+
+struct sparse_chunk
+{
+    uint64_t offs; // in expanded image
+    uint64_t size;
+    uint64_t data; // raw data in the file
+    uint32_t type;
+    uint32_t fill;
+};
+
+// returns false if the file is not a sparse image.
+static bool sparse_open(struct fsimage *i, const char *filename)
+{
+    struct sparse_header h;
+    uint64_t pos, file_size;
+    uint32_t n, max = 0;
+
+    if (pread(i->fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != SPARSE_HEADER_MAGIC)
+        return false;
+
+    if (h.major_version != 1 || h.file_hdr_sz < sizeof(h) ||
+        h.chunk_hdr_sz < sizeof(struct sparse_chunk_header) || h.blk_sz == 0 || h.blk_sz % 4)
+        fatal("unsupported sparse image %s. version %u, block size %u\n",
+              filename, h.major_version, h.blk_sz);
+
+    file_size = lseek(i->fd, 0, SEEK_END);
+    pos = h.file_hdr_sz;
+    for (n = 0; n < h.total_chunks; n++)
+    {
+        struct sparse_chunk_header ch;
+        struct sparse_chunk *c;
+        uint64_t size, data_size;
+
+        if (pread(i->fd, &ch, sizeof(ch), pos) != sizeof(ch))
+            fatal("cannot read sparse chunk %u at %llu.\n", n, (unsigned long long)pos);
+        size = (uint64_t)ch.chunk_sz * h.blk_sz;
+        data_size = ch.total_sz - h.chunk_hdr_sz;
+        if (ch.total_sz < h.chunk_hdr_sz || pos + ch.total_sz > file_size)
+            fatal("wrong sparse chunk %u size %u at %llu.\n", n, ch.total_sz, (unsigned long long)pos);
+
+        switch (ch.chunk_type)
+        {
+        case CHUNK_TYPE_RAW:
+            if (data_size != size)
+                fatal("wrong raw chunk %u size %u.\n", n, ch.total_sz);
+            break;
+        case CHUNK_TYPE_FILL:
+        case CHUNK_TYPE_CRC32:
+            if (data_size != 4)
+                fatal("wrong chunk %u size %u.\n", n, ch.total_sz);
+            break;
+        case CHUNK_TYPE_DONT_CARE:
+            break;
+        default:
+            fatal("unknown sparse chunk type 0x%x.\n", ch.chunk_type);
+        }
+
+        // crc32 chunks cover no blocks.
+        if (ch.chunk_type != CHUNK_TYPE_CRC32 && size)
+        {
+            if (i->chunk_count == max)
+            {
+                max = max ? max * 2 : 64;
+                i->chunks = realloc(i->chunks, max * sizeof(i->chunks[0]));
+                if (!i->chunks)
+                    fatal("no mem for sparse chunks. %u\n", max);
+            }
+            c = &i->chunks[i->chunk_count++];
+            c->offs = i->sparse_size;
+            c->size = size;
+            c->data = pos + h.chunk_hdr_sz;
+            c->type = ch.chunk_type;
+            c->fill = 0;
+            if (c->type == CHUNK_TYPE_FILL && pread(i->fd, &c->fill, 4, c->data) != 4)
+                fatal("cannot read fill chunk %u.\n", n);
+            i->sparse_size += size;
+        }
+        pos += ch.total_sz;
+    }
+
+    if (i->sparse_size != (uint64_t)h.total_blks * h.blk_sz)
+        fatal("sparse chunks have %llu bytes. header says %u blocks.\n",
+              (unsigned long long)i->sparse_size, h.total_blks);
+    debug("sparse image. %u chunks, %llu bytes expanded.\n", i->chunk_count,
+          (unsigned long long)i->sparse_size);
+
+    return true;
+}
+
+// chunk holding 'offs', or chunk_count beyond the end.
+static uint32_t sparse_find(struct fsimage *i, uint64_t offs)
+{
+    uint32_t lo = 0, hi = i->chunk_count;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (i->chunks[mid].offs + i->chunks[mid].size <= offs)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// 'size' bytes at 'offs' in a fill chunk. the value repeats from chunk start.
+static void sparse_fill(uint8_t *data, uint32_t fill, uint64_t offs, uint32_t size)
+{
+    const uint8_t *v = (const uint8_t *)&fill;
+    uint32_t n;
+
+    if (v[0] == v[1] && v[0] == v[2] && v[0] == v[3])
+    {
+        memset(data, v[0], size);
+        return;
+    }
+    for (n = 0; n < size; n++)
+        data[n] = v[(offs + n) % 4];
+}
+
+/* requests are split at chunk ends. raw parts are read at their place in the
+ * file with one batch. others are made here.
+ */
+static void
+sparse_readv_cb(void *priv, const struct ext4fs_read_req *req, uint32_t count)
+{
+    struct fsimage *i = priv;
+    struct ext4fs_read_req *raw = NULL;
+    uint32_t raw_count = 0, raw_max = 0;
+    uint32_t n;
+
+    for (n = 0; n < count; n++)
+    {
+        uint64_t offs = req[n].offs;
+        uint8_t *data = req[n].data;
+        uint32_t left = req[n].size;
+        uint32_t c;
+
+        for (c = sparse_find(i, offs); left; c++)
+        {
+            const struct sparse_chunk *ch = &i->chunks[c];
+            uint64_t in_chunk;
+            uint32_t len;
+
+            if (c >= i->chunk_count)
+                fatal("read out of image. offs %llu, size %u\n", (unsigned long long)offs, left);
+
+            in_chunk = offs - ch->offs;
+            len = ch->size - in_chunk < left ? ch->size - in_chunk : left;
+            switch (ch->type)
+            {
+            case CHUNK_TYPE_RAW:
+                if (raw_count == raw_max)
+                {
+                    raw_max = raw_max ? raw_max * 2 : 16;
+                    raw = realloc(raw, raw_max * sizeof(raw[0]));
+                    if (!raw)
+                        fatal("no mem for requests. %u\n", raw_max);
+                }
+                raw[raw_count].offs = ch->data + in_chunk;
+                raw[raw_count].data = data;
+                raw[raw_count].size = len;
+                raw_count++;
+                break;
+            case CHUNK_TYPE_FILL:
+                sparse_fill(data, ch->fill, in_chunk, len);
+                break;
+            default:
+                memset(data, 0, len);
+                break;
+            }
+
+            offs += len;
+            data += len;
+            left -= len;
+        }
+    }
+
+    if (i->image_readv && raw_count)
+        i->image_readv(priv, raw, raw_count);
+    else
+    {
+        for (n = 0; n < raw_count; n++)
+            i->image_read(priv, raw[n].offs, raw[n].data, raw[n].size);
+    }
+    free(raw);
+}
+
+static void
+sparse_read_cb(void *priv, uint64_t offs, void *data, uint32_t size)
+{
+    struct ext4fs_read_req req = {.offs = offs, .data = data, .size = size};
+
+    sparse_readv_cb(priv, &req, 1);
+}
+
+// only ranges within one raw chunk are lent.
+static const void *
+sparse_borrow_cb(void *priv, uint64_t offs, uint32_t size)
+{
+    struct fsimage *i = priv;
+    uint32_t c = sparse_find(i, offs);
+    const struct sparse_chunk *ch = &i->chunks[c];
+
+    if (c == i->chunk_count || ch->type != CHUNK_TYPE_RAW || offs + size > ch->offs + ch->size)
+        return NULL;
+
+    return map_borrow_cb(priv, ch->data + (offs - ch->offs), size);
+}
+
+// copies in kernel if the whole range is in raw chunks.
+static int
+sparse_copy_cb(void *priv, uint64_t offs, uint64_t size, int fd)
+{
+    struct fsimage *i = priv;
+    uint64_t end = offs + size;
+    uint32_t c, first = sparse_find(i, offs);
+
+    for (c = first; c < i->chunk_count && i->chunks[c].offs < end; c++)
+    {
+        if (i->chunks[c].type != CHUNK_TYPE_RAW)
+            return -1;
+    }
+
+    for (c = first; offs < end; c++)
+    {
+        const struct sparse_chunk *ch = &i->chunks[c];
+        uint64_t len = ch->offs + ch->size - offs;
+
+        if (c >= i->chunk_count)
+            fatal("copy out of image. offs %llu\n", (unsigned long long)offs);
+        if (len > end - offs)
+            len = end - offs;
+        // the first piece may fail with nothing written. later ones cannot.
+        if (copy_cb(priv, ch->data + (offs - ch->offs), len, fd) != 0)
+        {
+            if (c == first)
+                return -1;
+            fatal("copy to output failed. offs %llu\n", (unsigned long long)offs);
+        }
+        offs += len;
+    }
+
+    return 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
 int main(int argc, char **argv)
 {
+    struct ext4fs *e;
+    uint64_t t0, t1, t2;
     char *opt_debug = NULL;
+    int opt_log_level = EXT4FS_LOG_DUMP;
+    char *opt_cache = NULL;
+    bool opt_stats = false;
+    bool opt_mmap = false;
+    uint32_t opt_uring_depth = 0;
+    bool opt_copy = false;
+    bool opt_verify = false;
+    bool opt_journal = true;
     char *fs_filename = NULL;
 
     while (true)
     {
         int opt;
 
-        opt = getopt(argc, argv, "+d:");
+        opt = getopt(argc, argv, "+d:l:C:smu:zcJ");
         if (opt == -1)
             break;
 
@@ -127,12 +782,56 @@ int main(int argc, char **argv)
                             "\n"
                             " options:\n"
                             "   -d <filename>    : filename to save debug messages. \"-\" will print stderr.\n"
+                            "   -l <level>       : debug message level with -d. 1 for debug, 2 for dumps too. (default 2)\n"
+                            "   -C <bytes>       : block cache size. 0 disables block cache.\n"
+                            "   -s               : print statistics to stderr at exit.\n"
+                            "   -m               : map the image into memory and parse metadata in place.\n"
+                            "   -u <depth>       : read the image with io_uring, up to <depth> reads in flight.\n"
+                            "   -z               : copy file data to output in kernel. (copy_file_range, sendfile, splice)\n"
+                            "   -c               : verify metadata checksums.\n"
+                            "   -J               : ignore the journal of unclean filesystem.\n"
+                            "\n"
+                            " android sparse images are read as expanded, without expanding them.\n"
                             "\n");
             exit(1);
 
         case 'd':
             opt_debug = optarg;
             break;
+
+        case 'l':
+            opt_log_level = strtol(optarg, NULL, 0);
+            break;
+
+        case 'C':
+            opt_cache = optarg;
+            break;
+
+        case 's':
+            opt_stats = true;
+            break;
+
+        case 'm':
+            opt_mmap = true;
+            break;
+
+        case 'u':
+            opt_uring_depth = strtoul(optarg, NULL, 0);
+            if (opt_uring_depth == 0)
+                fatal("wrong io_uring depth. \"%s\"\n", optarg);
+            break;
+
+        case 'z':
+            opt_copy = true;
+            break;
+
+        case 'c':
+            opt_verify = true;
+            break;
+
+        case 'J':
+            opt_journal = false;
+            break;
         }
     }
 
@@ -169,13 +868,98 @@ int main(int argc, char **argv)
             fatal("..\n");
 
         ext4fs_set_message_callback(e, message_cb);
-        ext4fs_set_read_callback(e, read_cb);
+        if (debug_file)
+            ext4fs_set_log_level(e, opt_log_level);
+        if (opt_mmap)
+        {
+            map_image(&i, fs_filename);
+            i.image_read = map_read_cb;
+        }
+        else if (opt_uring_depth)
+        {
+            i.ring_depth = opt_uring_depth;
+            pthread_mutex_init(&i.ring_lock, NULL);
+            i.image_read = uring_read_cb;
+            i.image_readv = uring_readv_cb;
+        }
+        else
+        {
+            i.image_read = read_cb;
+            i.image_readv = preadv_cb;
+        }
+        // sparse images are read through the chunk index, over the above.
+        if (sparse_open(&i, fs_filename))
+        {
+            ext4fs_set_read_callback(e, sparse_read_cb);
+            ext4fs_set_readv_callback(e, sparse_readv_cb);
+            if (opt_mmap)
+                ext4fs_set_borrow_callback(e, sparse_borrow_cb);
+            if (opt_copy)
+                ext4fs_set_copy_callback(e, sparse_copy_cb);
+        }
+        else
+        {
+            ext4fs_set_read_callback(e, i.image_read);
+            if (i.image_readv)
+                ext4fs_set_readv_callback(e, i.image_readv);
+            if (opt_mmap)
+                ext4fs_set_borrow_callback(e, map_borrow_cb);
+            if (opt_copy)
+                ext4fs_set_copy_callback(e, copy_cb);
+        }
+        if (opt_cache)
+            ext4fs_set_cache_size(e, strtoull(opt_cache, NULL, 0));
+        ext4fs_set_verify(e, opt_verify);
+        ext4fs_set_journal(e, opt_journal);
 
+        t0 = now_ns();
         ext4fs_load(e);
+        t1 = now_ns();
         ext4fs_command(e, argv + optind);
+        t2 = now_ns();
+
+        if (opt_stats)
+        {
+            struct ext4fs_stats st;
+
+            ext4fs_get_stats(e, &st);
+            fprintf(stderr, "load %.3f ms, command %.3f ms\n",
+                    (t1 - t0) / 1e6, (t2 - t1) / 1e6);
+            fprintf(stderr, "reads %llu in %llu batches, %llu bytes, %.1f MB/s\n",
+                    (unsigned long long)st.reads,
+                    (unsigned long long)st.read_batches,
+                    (unsigned long long)st.read_bytes,
+                    st.read_bytes * 1e3 / (t2 - t1 + 1));
+            fprintf(stderr, "cache hits %llu, misses %llu, %llu bytes cached\n",
+                    (unsigned long long)st.cache_hits,
+                    (unsigned long long)st.cache_misses,
+                    (unsigned long long)st.cache_bytes);
+            fprintf(stderr, "dcache hits %llu, misses %llu, %llu entries\n",
+                    (unsigned long long)st.dcache_hits,
+                    (unsigned long long)st.dcache_misses,
+                    (unsigned long long)st.dcache_entries);
+            if (opt_verify)
+                fprintf(stderr, "checksums %llu computed, %llu cached\n",
+                        (unsigned long long)st.csum_checks,
+                        (unsigned long long)st.csum_cached);
+            if (st.journal_transactions)
+                fprintf(stderr, "journal %llu transactions, %llu blocks replayed\n",
+                        (unsigned long long)st.journal_transactions,
+                        (unsigned long long)st.journal_blocks);
+        }
 
         ext4fs_del(e);
 
+        if (i.map)
+            munmap(i.map, i.map_size);
+        while (i.rings)
+        {
+            struct uring *r = i.rings;
+
+            i.rings = r->next;
+            uring_del(r);
+        }
+        free(i.chunks);
         close(i.fd);
     }
 